@@ -0,0 +1,48 @@
+# Writes SPIR-V binaries to a C++ header as constexpr uint32_t arrays, so the executable needs no shader files.
+#
+# usage: cmake -DSPV_FILES="a.spv|b.spv" -DSYMBOLS="a_spv|b_spv" -DOUTPUT=embedded_shaders.h -P EmbedSpirv.cmake
+#
+string(REPLACE "|" ";" SPV_FILES "${SPV_FILES}")
+string(REPLACE "|" ";" SYMBOLS   "${SYMBOLS}")
+
+list(LENGTH SPV_FILES fileCount)
+list(LENGTH SYMBOLS   symbolCount)
+if(NOT fileCount EQUAL symbolCount)
+  message(FATAL_ERROR "EmbedSpirv: SPV_FILES and SYMBOLS must have the same length")
+endif()
+
+set(content "// generated by cmake/EmbedSpirv.cmake, do not edit\n\n#pragma once\n\n#include <cstdint>\n#include <cstddef>\n\nnamespace embedded_shaders\n{\n")
+
+math(EXPR lastIndex "${fileCount} - 1")
+foreach(i RANGE ${lastIndex})
+  list(GET SPV_FILES ${i} spvFile)
+  list(GET SYMBOLS   ${i} symbol)
+
+  file(READ "${spvFile}" hex HEX)
+  string(LENGTH "${hex}" hexLength)
+  math(EXPR remainder "${hexLength} % 8")
+  if(hexLength EQUAL 0 OR NOT remainder EQUAL 0)
+    message(FATAL_ERROR "EmbedSpirv: ${spvFile} is not a SPIR-V binary (size is not a multiple of 4)")
+  endif()
+
+  # SPIR-V words are little-endian in the file
+  #
+  string(REGEX REPLACE "([0-9a-f][0-9a-f])([0-9a-f][0-9a-f])([0-9a-f][0-9a-f])([0-9a-f][0-9a-f])" "0x\\4\\3\\2\\1u," words "${hex}")
+  string(REPEAT "0x[0-9a-f]+u," 8 eightWords) # cmake regex has no {n}
+  string(REGEX REPLACE "(${eightWords})" "\\1\n    " words "${words}")
+  string(STRIP "${words}" words)
+
+  string(APPEND content "  constexpr uint32_t ${symbol}[] =\n  {\n    ${words}\n  };\n")
+  string(APPEND content "  constexpr size_t   ${symbol}_size = sizeof(${symbol}); // in bytes\n\n")
+endforeach()
+
+string(APPEND content "}\n")
+
+# do not touch the header if nothing changed, so dependent sources are not rebuilt
+#
+if(EXISTS "${OUTPUT}")
+  file(READ "${OUTPUT}" oldContent)
+endif()
+if(NOT "${oldContent}" STREQUAL "${content}")
+  file(WRITE "${OUTPUT}" "${content}")
+endif()
@@ -1,8 +1,14 @@
-#version 330 core
+#version 450
+
+// set per pipeline variant (ShaderVariantSet), so the colour is folded into the code
+//
+layout(constant_id = 0) const float COLOR_R = 1.0;
+layout(constant_id = 1) const float COLOR_G = 0.0;
+layout(constant_id = 2) const float COLOR_B = 0.0;
 
 layout(location = 0) out vec4 color;
 
 void main()
 {
-  color = vec4(1.0f, 0.0f, 0.0f, 1.0f);
+  color = vec4(COLOR_R, COLOR_G, COLOR_B, 1.0f);
 }
\ No newline at end of file
@@ -16,13 +16,33 @@
 #include <cstdlib>
 #include <cstdint>
 #include <cassert>
+#include <memory>
+#include <deque>
+#include <exception>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <string>
 
 #include "vk_utils.h"
+#include "vk_memory.h"
+#include "vk_copy.h"
+#include "vk_pipeline.h"
+#include "vk_threads.h"
+#include "vk_trace.h"
+#include "vk_present.h"
+
+#include "embedded_shaders.h" // generated by cmake/EmbedSpirv.cmake
 
 const int WIDTH  = 800;
 const int HEIGHT = 600;
 
-const int MAX_FRAMES_IN_FLIGHT = 2;
+const int DEFRAG_PERIOD = 1000; // frames between defragmentation passes
+
+const char* PIPELINE_CACHE_FILE = "pipeline_cache.bin";
+const char* SHADER_DIR_ENV      = "VULKAN_MINIMAL_SHADER_DIR"; // if set, shaders are loaded from <dir>/vertex.vert.spv and <dir>/fragment.frag.spv instead of embedded ones
+const char* STARTUP_TRACE_ENV   = "VULKAN_MINIMAL_STARTUP_TRACE"; // if set, startup breakdown is printed and saved to this file for chrome://tracing
+const char* LATENCY_ENV         = "VULKAN_MINIMAL_LATENCY";       // lowest, throughput or power; '--latency <name>' overrides it
 
 const std::vector<const char*> deviceExtensions = {
   VK_KHR_SWAPCHAIN_EXTENSION_NAME
@@ -38,12 +58,43 @@ class HelloTriangleApplication
 {
 public:
 
+  explicit HelloTriangleApplication(const vk_utils::SwapChainPolicy& a_policy) : m_swapChainPolicy(a_policy), 
+                                                                                 m_framesInFlight(std::max(a_policy.framesInFlight, 1u)) {}
+
   void run() 
   {
-    InitWindow();
-    
-    InitVulkan();
-    CreateResources();
+    // startup ends when the first frame is submitted; it is the time user waits for a window with something in it
+    //
+    {
+      TRACE_SCOPE("startup");
+      glfwInit();
+      m_pThreadPool.reset(new vk_utils::ThreadPool());
+
+      // each step starts as soon as its inputs exist, so startup takes the critical path instead of the sum of all steps
+      //
+      vk_utils::TaskGraph graph(m_pThreadPool.get());
+      auto windowTask       = graph.AddMainThread("InitWindow", [this]() { InitWindow(); });
+      auto instanceTask     = graph.Add("InitInstance",       [this]() { InitInstance(); });
+      auto shaderFilesTask  = graph.Add("MapShaderFiles",     [this]() { MapShaderFiles(); });
+      auto surfaceTask      = graph.Add("InitSurface",        [this]() { InitSurface(); },        { windowTask, instanceTask });
+      auto physDeviceTask   = graph.Add("PickPhysicalDevice", [this]() { PickPhysicalDevice(); }, { instanceTask });
+      auto deviceTask       = graph.Add("InitDevice",         [this]() { InitDevice(); },         { physDeviceTask, surfaceTask });
+      auto swapChainTask    = graph.Add("InitSwapChain",      [this]() { InitSwapChain(); },      { deviceTask });
+      auto renderPassTask   = graph.Add("InitRenderPass",     [this]() { InitRenderPass(); },     { deviceTask });
+      auto shadersTask      = graph.Add("InitShaders",        [this]() { InitShaders(); },        { deviceTask, shaderFilesTask });
+      auto cacheTask        = graph.Add("InitPipelineCache",  [this]() { InitPipelineCache(); },  { deviceTask });
+      graph.Add("InitPipelines",    [this]() { InitPipelines(); },    { renderPassTask, shadersTask, cacheTask });
+      graph.Add("InitFrameBuffers", [this]() { InitFrameBuffers(); }, { swapChainTask, renderPassTask });
+      graph.Add("InitMemory",       [this]() { InitMemory(); },       { deviceTask });
+      graph.Add("InitCommands",     [this]() { InitCommands(); },     { deviceTask });
+      graph.Run();
+
+      TRACE_SCOPE("first frame");
+      glfwPollEvents();
+      ProcessEvents(); // render thread is not started yet, so main thread may consume events for now
+      DrawFrame();
+    }
+    ReportStartup();
 
     MainLoop();
 
@@ -64,18 +115,51 @@ private:
 
   VkQueue graphicsQueue;
   VkQueue presentQueue;
+  VkQueue transferQueue; // same as graphicsQueue if device does not have a dedicated transfer family
 
   vk_utils::ScreenBufferResources screen;
 
   VkRenderPass     renderPass;
   VkPipelineLayout pipelineLayout;
-  VkPipeline       graphicsPipeline;
+  VkPipeline       graphicsPipeline = VK_NULL_HANDLE; // null or fast-linked until m_pipelineFuture is ready; owned by m_pPipelineCompiler or m_pPipelineLibrary
+  VkPipelineCache  m_pipelineCache  = VK_NULL_HANDLE; // loaded at startup and saved in Cleanup, so warm starts skip shader compilation
+
+  std::unique_ptr<vk_utils::ThreadPool>              m_pThreadPool;
+  std::unique_ptr<vk_utils::ShaderModuleCache>       m_pShaders;
+  vk_utils::ShaderRef                                m_vertShader;
+  vk_utils::ShaderRef                                m_fragShader;
+  std::unique_ptr<vk_utils::PipelineCompiler>        m_pPipelineCompiler; // pipelines are built on worker threads, frames are drawn meanwhile
+  std::unique_ptr<vk_utils::PipelineRegistry>        m_pPipelines;        // equal descriptions give the same pipeline
+  std::shared_future<VkPipeline>                     m_pipelineFuture;    // replaces graphicsPipeline when ready
+  std::unique_ptr<vk_utils::GraphicsPipelineLibrary> m_pPipelineLibrary;  // null if VK_EXT_graphics_pipeline_library is not supported
+  vk_utils::ExtendedDynamicStateFuncs                m_dynamicState;      // cull mode, front face and topology at record time, if supported
+  bool                                               m_hasPipelineLibrary = false;
+  std::unique_ptr<vk_utils::MappedFile>              m_pVertFile;         // only if SHADER_DIR_ENV is set; released when modules are created
+  std::unique_ptr<vk_utils::MappedFile>              m_pFragFile;         //
+
+  // passed between startup tasks
+  //
+  uint32_t                 m_graphicsFamily     = 0;
+  uint32_t                 m_transferFamily     = 0;
+  std::vector<const char*> m_deviceExtensions;
+  bool                     m_hasProps2          = false;
+  bool                     m_hasMemoryBudget    = false;
+  bool                     m_hasExtDynamicState = false;
 
   VkCommandPool                commandPool;
-  std::vector<VkCommandBuffer> commandBuffers;
+  std::vector<VkCommandBuffer> commandBuffers; // one per frame in flight, recorded every frame
 
-  VkBuffer       m_vbo;     //  
-  VkDeviceMemory m_vboMem;  // we will store our vertices data here
+  std::unique_ptr<vk_utils::DeviceMemoryAllocator> m_pAlloc;    // all buffers and images take their memory from here
+  std::unique_ptr<vk_utils::StagingUploader>       m_pUploader; // and get their data through staging ring
+
+  vk_utils::AllocatedBuffer* m_pVBO = nullptr; // we will store our vertices data here; handle may change after defragmentation
+
+  std::unique_ptr<vk_utils::MemoryDefragmenter> m_pDefrag;
+  uint64_t                                      m_frameCounter    = 0;
+
+  bool m_residencyReportRequested = false; // by F12, the report is written after present
+
+  std::unique_ptr<vk_utils::FrameLinearAllocator> m_pFrameAlloc; // per-frame vertex, uniform and instance data
 
   struct SyncObj
   {
@@ -86,14 +170,115 @@ private:
 
   size_t currentFrame = 0;
 
-  void InitWindow() 
+  // swap chain images and frames in flight come from the latency policy; sync objects and command buffers are per frame in flight
+  //
+  vk_utils::SwapChainPolicy m_swapChainPolicy;
+  uint32_t                  m_framesInFlight;
+
+  std::unique_ptr<vk_utils::FramePacer> m_pPacer;             // null if the policy does not ask for frame pacing
+  bool                                  m_hasPresentWait = false;
+  double                                m_refreshRate    = 0.0; // of the primary monitor, 0 if unknown
+
+  // screen resources replaced by RecreateSwapChain; frames in flight may still use them
+  //
+  struct RetiredScreen
   {
-    glfwInit();
+    vk_utils::ScreenBufferResources screen;
+    uint64_t                        releaseSubmit; // destroyed when m_submitCount reaches this value
+  };
+
+  std::deque<RetiredScreen> m_retiredScreens;
+  std::vector<VkFence>      m_imagesInFlight; // fence of the last frame that rendered to each swap chain image, null if none
+  uint64_t                  m_submitCount    = 0;
+  bool                      m_swapChainDirty = false; // window was resized or the swap chain does not match the surface anymore
+  int                       m_windowWidth    = 0;     // framebuffer size in pixels as last reported by the event thread
+  int                       m_windowHeight   = 0;     //
+
+  // Main thread owns GLFW and only waits for window events; the render thread owns queues and everything per frame.
+  // Callbacks translate events to WindowEvent and the render loop takes them right before it records a frame.
+  //
+  struct WindowEvent
+  {
+    enum TYPE { KEY = 0, RESIZE = 1 };
+
+    TYPE type;
+    int  key;    // KEY
+    int  action; //
+    int  width;  // RESIZE
+    int  height; //
+  };
 
+  vk_utils::SpscQueue<WindowEvent> m_events{1024};
+  std::atomic<uint32_t>            m_droppedEvents{0}; // render thread was too slow to take them
+  std::atomic<bool>                m_stopRendering{false};
+  std::thread                      m_renderThread;
+  std::exception_ptr               m_renderError; // written by render thread before it stops, read after join
+
+  void InitWindow() 
+  {
     glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+    glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
 
     window = glfwCreateWindow(WIDTH, HEIGHT, "Vulkan", nullptr, nullptr);
+    glfwSetWindowUserPointer(window, this);
+    glfwSetKeyCallback(window, KeyCallback);
+    glfwSetFramebufferSizeCallback(window, FramebufferSizeCallback);
+
+    glfwGetFramebufferSize(window, &m_windowWidth, &m_windowHeight);
+
+    const GLFWvidmode* pMode = glfwGetVideoMode(glfwGetPrimaryMonitor());
+    if (pMode != nullptr)
+      m_refreshRate = double(pMode->refreshRate);
+  }
+
+  // some platforms never return VK_ERROR_OUT_OF_DATE_KHR on resize, so it is tracked here as well
+  //
+  static void FramebufferSizeCallback(GLFWwindow* a_window, int a_width, int a_height)
+  {
+    auto pApp = (HelloTriangleApplication*)glfwGetWindowUserPointer(a_window);
+
+    WindowEvent event = {};
+    event.type   = WindowEvent::RESIZE;
+    event.width  = a_width;
+    event.height = a_height;
+    pApp->PushEvent(event);
+  }
+
+  static void KeyCallback(GLFWwindow* a_window, int a_key, int a_scancode, int a_action, int a_mods)
+  {
+    auto pApp = (HelloTriangleApplication*)glfwGetWindowUserPointer(a_window);
+
+    WindowEvent event = {};
+    event.type   = WindowEvent::KEY;
+    event.key    = a_key;
+    event.action = a_action;
+    pApp->PushEvent(event);
+  }
+
+  void PushEvent(const WindowEvent& a_event)
+  {
+    if (!m_events.TryPush(a_event))
+      m_droppedEvents++;
+  }
+
+  // render thread side; RESIZE carries the size, so the event thread is never asked for it
+  //
+  void ProcessEvents()
+  {
+    WindowEvent event;
+    while (m_events.TryPop(&event))
+    {
+      if (event.type == WindowEvent::RESIZE)
+      {
+        m_windowWidth    = event.width;
+        m_windowHeight   = event.height;
+        m_swapChainDirty = true;
+      }
+      else if (event.type == WindowEvent::KEY && event.key == GLFW_KEY_F12 && event.action == GLFW_PRESS)
+      {
+        m_residencyReportRequested = true;
+      }
+    }
   }
 
   static VKAPI_ATTR VkBool32 VKAPI_CALL debugReportCallbackFn(
@@ -112,10 +297,8 @@ private:
   VkDebugReportCallbackEXT debugReportCallback;
   
 
-  void InitVulkan() 
+  void InitInstance()
   {
-    const int deviceId = 0;
-
     std::vector<const char*> extensions;
     {
       uint32_t glfwExtensionCount = 0;
@@ -124,63 +307,292 @@ private:
       extensions     = std::vector<const char*>(glfwExtensions, glfwExtensions + glfwExtensionCount);
     }
 
+    // needed by VK_EXT_memory_budget on Vulkan 1.0 instance
+    //
+    m_hasProps2 = vk_utils::IsInstanceExtensionSupported(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+    if (m_hasProps2)
+      extensions.push_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+
     instance = vk_utils::CreateInstance(enableValidationLayers, enabledLayers, extensions);
     if (enableValidationLayers)
       vk_utils::InitDebugReportCallback(instance, &debugReportCallbackFn, &debugReportCallback);
+  }
 
+  void InitSurface()
+  {
     if (glfwCreateWindowSurface(instance, window, nullptr, &surface) != VK_SUCCESS)
       throw std::runtime_error("glfwCreateWindowSurface: failed to create window surface!");
-  
-    physicalDevice = vk_utils::FindPhysicalDevice(instance, true, deviceId);
-    auto queueFID  = vk_utils::GetQueueFamilyIndex(physicalDevice, VK_QUEUE_GRAPHICS_BIT);
+  }
+
+  // everything that needs only the instance: device, queue families and extensions to enable
+  //
+  void PickPhysicalDevice()
+  {
+    const int deviceId = 0;
+
+    physicalDevice   = vk_utils::FindPhysicalDevice(instance, true, deviceId);
+    m_graphicsFamily = vk_utils::GetQueueFamilyIndex(physicalDevice, VK_QUEUE_GRAPHICS_BIT);
+
+    // uploads go through the DMA engine when possible, so they overlap with rendering instead of waiting behind it
+    //
+    m_transferFamily = vk_utils::GetTransferQueueFamilyIndex(physicalDevice, m_graphicsFamily);
+
+    m_deviceExtensions = deviceExtensions;
+    m_hasMemoryBudget  = m_hasProps2 && vk_utils::IsDeviceExtensionSupported(physicalDevice, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+    if (m_hasMemoryBudget)
+      m_deviceExtensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+
+    // more state at record time means less pipelines; viewport and scissor are dynamic anyway
+    //
+    m_hasExtDynamicState = m_hasProps2 && vk_utils::IsExtendedDynamicStateSupported(instance, physicalDevice);
+    if (m_hasExtDynamicState)
+      m_deviceExtensions.push_back(VK_EXT_EXTENDED_DYNAMIC_STATE_EXTENSION_NAME);
+
+    // new pipelines are linked from precompiled parts in microseconds, full optimization runs in background
+    //
+  #ifdef VK_EXT_graphics_pipeline_library
+    m_hasPipelineLibrary = m_hasProps2 && vk_utils::GraphicsPipelineLibrary::IsSupported(instance, physicalDevice);
+    if (m_hasPipelineLibrary)
+    {
+      m_deviceExtensions.push_back(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME);
+      m_deviceExtensions.push_back(VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME);
+    }
+  #endif
 
+    // frame pacer sees real vblank times only with present wait, otherwise it falls back to a CPU timer
+    //
+  #if defined(VK_KHR_present_id) && defined(VK_KHR_present_wait)
+    m_hasPresentWait = m_swapChainPolicy.framePacing && m_hasProps2 && vk_utils::FramePacer::IsPresentWaitSupported(instance, physicalDevice);
+    if (m_hasPresentWait)
+    {
+      m_deviceExtensions.push_back(VK_KHR_PRESENT_ID_EXTENSION_NAME);
+      m_deviceExtensions.push_back(VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+    }
+  #endif
+  }
+
+  void InitDevice()
+  {
     VkBool32 presentSupport = false;
-    vkGetPhysicalDeviceSurfaceSupportKHR(physicalDevice, queueFID, surface, &presentSupport);
+    vkGetPhysicalDeviceSurfaceSupportKHR(physicalDevice, m_graphicsFamily, surface, &presentSupport);
     if (!presentSupport)
       throw std::runtime_error("vkGetPhysicalDeviceSurfaceSupportKHR: no present support for the target device and graphics queue");
 
-    device = vk_utils::CreateLogicalDevice(queueFID, physicalDevice, enabledLayers, deviceExtensions);
-    vkGetDeviceQueue(device, queueFID, 0, &graphicsQueue);
-    vkGetDeviceQueue(device, queueFID, 0, &presentQueue);
-    
-    // ==> commadnPool
+    VkPhysicalDeviceExtendedDynamicStateFeaturesEXT dynamicStateFeatures = {};
+    dynamicStateFeatures.sType                = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_FEATURES_EXT;
+    dynamicStateFeatures.extendedDynamicState = VK_TRUE;
+
+    void* pFeatureChain = nullptr;
+    if (m_hasExtDynamicState)
+      pFeatureChain = &dynamicStateFeatures;
+
+  #ifdef VK_EXT_graphics_pipeline_library
+    VkPhysicalDeviceGraphicsPipelineLibraryFeaturesEXT libraryFeatures = {};
+    libraryFeatures.sType                   = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_FEATURES_EXT;
+    libraryFeatures.graphicsPipelineLibrary = VK_TRUE;
+
+    if (m_hasPipelineLibrary)
     {
-      VkCommandPoolCreateInfo poolInfo = {};
-      poolInfo.sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-      poolInfo.queueFamilyIndex = vk_utils::GetQueueFamilyIndex(physicalDevice, VK_QUEUE_GRAPHICS_BIT);
+      libraryFeatures.pNext = pFeatureChain;
+      pFeatureChain         = &libraryFeatures;
+    }
+  #endif
 
-      if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) != VK_SUCCESS)
-        throw std::runtime_error("[CreateCommandPoolAndBuffers]: failed to create command pool!");
+  #if defined(VK_KHR_present_id) && defined(VK_KHR_present_wait)
+    VkPhysicalDevicePresentIdFeaturesKHR presentIdFeatures = {};
+    presentIdFeatures.sType     = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+    presentIdFeatures.presentId = VK_TRUE;
+
+    VkPhysicalDevicePresentWaitFeaturesKHR presentWaitFeatures = {};
+    presentWaitFeatures.sType       = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+    presentWaitFeatures.presentWait = VK_TRUE;
+
+    if (m_hasPresentWait)
+    {
+      presentWaitFeatures.pNext = pFeatureChain;
+      presentIdFeatures.pNext   = &presentWaitFeatures;
+      pFeatureChain             = &presentIdFeatures;
     }
+  #endif
 
-    vk_utils::CreateCwapChain(physicalDevice, device, surface, WIDTH, HEIGHT,
-                              &screen);
+    device = vk_utils::CreateLogicalDevice({m_graphicsFamily, m_transferFamily}, physicalDevice, enabledLayers, m_deviceExtensions,
+                                           pFeatureChain);
+    if (m_hasExtDynamicState)
+      m_dynamicState = vk_utils::LoadExtendedDynamicState(device);
+    vkGetDeviceQueue(device, m_graphicsFamily, 0, &graphicsQueue);
+    vkGetDeviceQueue(device, m_graphicsFamily, 0, &presentQueue);
+    vkGetDeviceQueue(device, m_transferFamily, 0, &transferQueue);
 
-    vk_utils::CreateScreenImageViews(device, &screen);
+    if (m_swapChainPolicy.framePacing)
+    {
+      m_pPacer.reset(new vk_utils::FramePacer(device, m_hasPresentWait, m_refreshRate));
+      std::cout << "[InitDevice]: frame pacing with " << (m_pPacer->IsPresentWaitEnabled() ? "present wait" : "CPU timer") << std::endl;
+    }
   }
 
-  void CreateResources()
+  // framebuffer size is taken from the window (InitWindow runs before, surface depends on it); it may differ from
+  // WIDTH x HEIGHT on HiDPI displays, and surfaces with undefined currentExtent (Wayland) take it as is
+  //
+  void InitSwapChain()
   {
-    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    vk_utils::CreateCwapChain(physicalDevice, device, surface, m_windowWidth, m_windowHeight,
+                              &screen, VK_NULL_HANDLE, m_swapChainPolicy);
 
-    CreateRenderPass(device, screen.swapChainImageFormat, 
+    vk_utils::CreateScreenImageViews(device, &screen);
+    m_imagesInFlight.assign(screen.swapChainImages.size(), VK_NULL_HANDLE);
+
+    std::cout << "[InitSwapChain]: " << vk_utils::GetPresentModeName(screen.presentMode) << ", " << screen.swapChainImages.size()
+              << " images, " << m_framesInFlight << " frames in flight" << std::endl;
+
+    // without vsync frames are shown immediately and never queue up, so there is no vblank to pace to
+    //
+    if (m_pPacer != nullptr && screen.presentMode == VK_PRESENT_MODE_IMMEDIATE_KHR)
+    {
+      m_pPacer = nullptr;
+      std::cout << "[InitSwapChain]: frame pacing is off for " << vk_utils::GetPresentModeName(screen.presentMode) << std::endl;
+    }
+  }
+
+  // render pass needs only the format, so pipelines do not wait for the swap chain
+  //
+  void InitRenderPass()
+  {
+    CreateRenderPass(device, vk_utils::ChooseSurfaceFormat(physicalDevice, surface).format,
                      &renderPass);
+  }
 
-    CreateGraphicsPipeline(device, screen.swapChainExtent, renderPass, 
-                           &pipelineLayout, &graphicsPipeline);
-  
-    CreateScreenFrameBuffers(device, renderPass, &screen);
+  void InitFrameBuffers()
+  {
+    vk_utils::CreateScreenFrameBuffers(device, renderPass, &screen);
+  }
+
+  // New swap chain is created from the old one, so the driver may recycle its images. Only image views and framebuffers
+  // are rebuilt: viewport and scissor are dynamic, so pipelines stay. Old resources are not destroyed here, which would
+  // need vkDeviceWaitIdle, but retired until frames that use them are complete. Returns false if the window is minimized.
+  //
+  bool RecreateSwapChain()
+  {
+    if (m_windowWidth == 0 || m_windowHeight == 0)
+      return false;
+
+    vk_utils::ScreenBufferResources newScreen = {};
+    vk_utils::CreateCwapChain(physicalDevice, device, surface, m_windowWidth, m_windowHeight,
+                              &newScreen, screen.swapChain, m_swapChainPolicy);
+    if (newScreen.swapChainImageFormat != screen.swapChainImageFormat)
+      throw std::runtime_error("[RecreateSwapChain]: surface format has changed, render pass is not compatible anymore");
+
+    vk_utils::CreateScreenImageViews(device, &newScreen);
+    vk_utils::CreateScreenFrameBuffers(device, renderPass, &newScreen);
+
+    // frame N waits for the fence of frame (N - m_framesInFlight), so after that many submits all frames that could use
+    // the old swap chain are complete; one more submit is left for the presentation engine, which has no fence
+    //
+    RetiredScreen retired;
+    retired.screen        = screen;
+    retired.releaseSubmit = m_submitCount + m_framesInFlight + 1;
+    m_retiredScreens.push_back(retired);
+
+    screen           = newScreen;
+    m_swapChainDirty = false;
+    if (m_pPacer != nullptr)
+      m_pPacer->Reset();
+    m_imagesInFlight.assign(screen.swapChainImages.size(), VK_NULL_HANDLE);
+    return true;
+  }
+
+  void ReleaseRetiredScreens()
+  {
+    while (!m_retiredScreens.empty() && m_retiredScreens.front().releaseSubmit <= m_submitCount)
+    {
+      DestroyScreen(device, m_retiredScreens.front().screen);
+      m_retiredScreens.pop_front();
+    }
+  }
+
+  static void DestroyScreen(VkDevice a_device, const vk_utils::ScreenBufferResources& a_screen)
+  {
+    for (auto framebuffer : a_screen.swapChainFramebuffers)
+      vkDestroyFramebuffer(a_device, framebuffer, nullptr);
+    for (auto imageView : a_screen.swapChainImageViews)
+      vkDestroyImageView(a_device, imageView, nullptr);
+    vkDestroySwapchainKHR(a_device, a_screen.swapChain, nullptr);
+  }
 
-    CreateVertexBuffer(device, physicalDevice, 6*2*sizeof(float),
-                       &m_vbo, &m_vboMem);
+  // SPIR-V is embedded into the executable, so normally there is no shader file I/O at all;
+  // during shader development set SHADER_DIR_ENV to take fresh .spv files without rebuilding.
+  // Files are mapped and checked before the device exists, modules are created from the mapping later.
+  //
+  void MapShaderFiles()
+  {
+    const char* shaderDir = getenv(SHADER_DIR_ENV);
+    if (shaderDir == nullptr || shaderDir[0] == '\0')
+      return;
 
-    CreateAndWriteCommandBuffers(device, commandPool, screen.swapChainFramebuffers, screen.swapChainExtent, renderPass, graphicsPipeline, m_vbo,
-                                 &commandBuffers);
+    m_pVertFile = MapShaderFile((std::string(shaderDir) + "/vertex.vert.spv").c_str());
+    m_pFragFile = MapShaderFile((std::string(shaderDir) + "/fragment.frag.spv").c_str());
+  }
 
-    CreateSyncObjects(device, &m_sync);
+  void InitShaders()
+  {
+    m_pShaders.reset(new vk_utils::ShaderModuleCache(device));
+    m_vertShader = LoadShader(m_pShaders.get(), m_pVertFile.get(), embedded_shaders::vertex_vert_spv,   embedded_shaders::vertex_vert_spv_size);
+    m_fragShader = LoadShader(m_pShaders.get(), m_pFragFile.get(), embedded_shaders::fragment_frag_spv, embedded_shaders::fragment_frag_spv_size);
+    m_pVertFile  = nullptr; // modules keep their own copy of the code
+    m_pFragFile  = nullptr;
+  }
+
+  void InitPipelineCache()
+  {
+    m_pipelineCache = vk_utils::CreatePipelineCache(device, physicalDevice, PIPELINE_CACHE_FILE);
+    CreatePipelineLayout(device, &pipelineLayout);
+
+    m_pPipelineCompiler.reset(new vk_utils::PipelineCompiler(device, m_pipelineCache, m_pThreadPool.get()));
+    m_pPipelines.reset(new vk_utils::PipelineRegistry(m_pPipelineCompiler.get()));
+  }
+
+  // pipeline is compiled in background while the rest is created; frames are cleared only until it is ready
+  //
+  void InitPipelines()
+  {
+    // triangle colour is a specialization constant of the fragment shader; only red is used now, so only red is prebuilt
+    //
+    vk_utils::ShaderVariantSet variants(TrianglePipelineDesc(m_vertShader, m_fragShader, renderPass, pipelineLayout, m_dynamicState.IsEnabled()));
+    const std::vector<uint32_t> offOn = { vk_utils::SpecFloat(0.0f), vk_utils::SpecFloat(1.0f) };
+    variants.AddConstant(VK_SHADER_STAGE_FRAGMENT_BIT, 0, offOn); // COLOR_R
+    variants.AddConstant(VK_SHADER_STAGE_FRAGMENT_BIT, 1, offOn); // COLOR_G
+    variants.AddConstant(VK_SHADER_STAGE_FRAGMENT_BIT, 2, offOn); // COLOR_B
+
+    const uint64_t red = variants.GetVariantIndex({ vk_utils::SpecFloat(1.0f), vk_utils::SpecFloat(0.0f), vk_utils::SpecFloat(0.0f) });
+    if (m_hasPipelineLibrary)
+    {
+      m_pPipelineLibrary.reset(new vk_utils::GraphicsPipelineLibrary(device, m_pipelineCache, m_pThreadPool.get()));
+      graphicsPipeline = m_pPipelineLibrary->Link(variants.GetVariant(red), &m_pipelineFuture);
+    }
+    else
+      m_pipelineFuture = variants.Prebuild(m_pPipelines.get(), { red })[0];
+  }
+
+  // the only task that uses the allocator and submits to queues during startup, so neither needs locking
+  //
+  void InitMemory()
+  {
+    m_pAlloc.reset(new vk_utils::DeviceMemoryAllocator(device, physicalDevice));
+    if (m_hasMemoryBudget)
+      m_pAlloc->EnableMemoryBudgetExt(instance);
+
+    // this is the place to evict streamed assets; the sample has nothing to evict, so just report
+    //
+    m_pAlloc->SetBudgetCallback([](uint32_t a_heapId, const vk_utils::HeapBudget& a_budget)
+    {
+      std::cout << "[DeviceMemoryAllocator]: heap " << a_heapId << " is over high-water mark, usage = " << a_budget.usage/(1024*1024)
+                << " MB, budget = " << a_budget.budget/(1024*1024) << " MB" << std::endl;
+    });
+    m_pUploader.reset(new vk_utils::StagingUploader(m_pAlloc.get(), transferQueue, m_transferFamily, graphicsQueue, m_graphicsFamily));
+
+    m_pVBO = CreateVertexBuffer(m_pAlloc.get(), 6*2*sizeof(float));
+
+    m_pFrameAlloc.reset(new vk_utils::FrameLinearAllocator(m_pAlloc.get(), 1024*1024, m_framesInFlight));
 
-   
     // put our vertices to GPU
     //
     float trianglePos[] =
@@ -190,27 +602,127 @@ private:
       0.0f, +0.5f,
     };
 
-    PutTriangleVerticesToVBO_Now(device, commandPool, graphicsQueue, trianglePos, 6*2,
-                                 m_vbo);
+    PutTriangleVerticesToVBO_Now(m_pUploader.get(), trianglePos, 6*2,
+                                 m_pVBO->buffer);
+
+    // command buffers are recorded each frame with current m_pVBO->buffer, so moved buffers need no move callback
+    //
+    m_pDefrag.reset(new vk_utils::MemoryDefragmenter(m_pAlloc.get(), graphicsQueue, m_graphicsFamily, m_framesInFlight));
   }
 
+  void InitCommands()
+  {
+    // ==> commadnPool
+    {
+      VkCommandPoolCreateInfo poolInfo = {};
+      poolInfo.sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+      poolInfo.flags            = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT; // command buffers are recorded again each frame
+      poolInfo.queueFamilyIndex = m_graphicsFamily;
+
+      if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) != VK_SUCCESS)
+        throw std::runtime_error("[CreateCommandPoolAndBuffers]: failed to create command pool!");
+    }
 
+    CreateCommandBuffers(device, commandPool, m_framesInFlight,
+                         &commandBuffers);
+
+    CreateSyncObjects(device, m_framesInFlight, &m_sync);
+  }
+
+
+  // Event thread: the OS may block it for a long time (window move or resize on Windows), the render thread keeps going.
+  //
   void MainLoop()
   {
-    while (!glfwWindowShouldClose(window)) 
+    m_renderThread = std::thread(&HelloTriangleApplication::RenderLoop, this);
+
+    while (!glfwWindowShouldClose(window) && !m_stopRendering)
+      glfwWaitEvents();
+
+    m_stopRendering = true;
+    m_renderThread.join();
+
+    vkDeviceWaitIdle(device);
+
+    if (m_droppedEvents != 0)
+      std::cout << "[MainLoop]: " << m_droppedEvents << " window events were dropped, event queue was full" << std::endl;
+    if (m_renderError)
+      std::rethrow_exception(m_renderError);
+  }
+
+  void RenderLoop()
+  {
+    try
     {
-      glfwPollEvents();
-      DrawFrame();
+      RenderFrames();
+    }
+    catch (...)
+    {
+      m_renderError = std::current_exception();
     }
 
-    vkDeviceWaitIdle(device);
+    m_stopRendering = true;
+    glfwPostEmptyEvent(); // wakes the event thread, if it was the render thread that decided to stop
+  }
+
+  void RenderFrames()
+  {
+    while (!m_stopRendering) 
+    {
+      if (m_pPacer != nullptr) // sleeps until the latest moment to sample input and still make the next vblank
+        m_pPacer->BeginFrame(screen.swapChain);
+
+      ProcessEvents();
+      if (!DrawFrame())
+        std::this_thread::sleep_for(std::chrono::milliseconds(10)); // minimized, nothing to draw until a resize event
+
+      // after present, so the frame that is already queued is not delayed by the file write
+      //
+      if (m_residencyReportRequested)
+      {
+        m_residencyReportRequested = false;
+        m_pAlloc->SaveResidencyReport("memory_report.json");
+        std::cout << "memory residency report is saved to memory_report.json" << std::endl;
+      }
+    }
+
+    if (m_pPacer != nullptr && m_pPacer->GetLatencyMs() > 0.0)
+      std::cout << "[RenderFrames]: frame start to display latency is " << m_pPacer->GetLatencyMs() << " ms on average" << std::endl;
+  }
+
+  void ReportStartup()
+  {
+    vk_utils::StartupTracer& tracer = vk_utils::StartupTracer::Instance();
+    tracer.Stop();
+
+    const char* traceFile = getenv(STARTUP_TRACE_ENV);
+    if (traceFile == nullptr || traceFile[0] == '\0')
+      return;
+
+    tracer.PrintSummary(std::cout);
+    if (tracer.SaveChromeTrace(traceFile))
+      std::cout << "[ReportStartup]: trace is saved to " << traceFile << std::endl;
   }
 
   void Cleanup() 
   { 
+    m_pAlloc->SaveResidencyReport("memory_report_exit.json"); // anything that is still alive at this point is listed here
+
     // free our vbo
-    vkFreeMemory(device, m_vboMem, NULL);
-    vkDestroyBuffer(device, m_vbo, NULL);
+    m_pDefrag     = nullptr;
+    m_pAlloc->DestroyBuffer(m_pVBO);
+    m_pUploader   = nullptr;
+    m_pFrameAlloc = nullptr;
+    m_pAlloc      = nullptr;
+
+    m_pPipelineLibrary  = nullptr;
+    m_pPipelines        = nullptr;
+    m_pPipelineCompiler = nullptr; // waits for unfinished jobs and destroys pipelines
+    m_pThreadPool       = nullptr;
+
+    m_pShaders->Release(m_vertShader); // no pipeline is being built now
+    m_pShaders->Release(m_fragShader);
+    m_pShaders = nullptr;
 
     if (enableValidationLayers)
     {
@@ -221,7 +733,7 @@ private:
       func(instance, debugReportCallback, NULL);
     }
 
-    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) 
+    for (size_t i = 0; i < m_framesInFlight; i++) 
     {
       vkDestroySemaphore(device, m_sync.renderFinishedSemaphores[i], nullptr);
       vkDestroySemaphore(device, m_sync.imageAvailableSemaphores[i], nullptr);
@@ -230,19 +742,16 @@ private:
 
     vkDestroyCommandPool(device, commandPool, nullptr);
 
-    for (auto framebuffer : screen.swapChainFramebuffers) {
-      vkDestroyFramebuffer(device, framebuffer, nullptr);
-    }
+    for (const auto& retired : m_retiredScreens) // device is idle after MainLoop
+      DestroyScreen(device, retired.screen);
+    m_retiredScreens.clear();
+    DestroyScreen(device, screen);
 
-    vkDestroyPipeline      (device, graphicsPipeline, nullptr);
+    vk_utils::SavePipelineCache(device, m_pipelineCache, PIPELINE_CACHE_FILE);
+    vkDestroyPipelineCache (device, m_pipelineCache, nullptr);
     vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
     vkDestroyRenderPass    (device, renderPass, nullptr);
 
-    for (auto imageView : screen.swapChainImageViews) {
-      vkDestroyImageView(device, imageView, nullptr);
-    }
-
-    vkDestroySwapchainKHR(device, screen.swapChain, nullptr);
     vkDestroyDevice(device, nullptr);
 
     vkDestroySurfaceKHR(instance, surface, nullptr);
@@ -256,6 +765,7 @@ private:
   static void CreateRenderPass(VkDevice a_device, VkFormat a_swapChainImageFormat,
                                VkRenderPass* a_pRenderPass)
   {
+    TRACE_SCOPE("CreateRenderPass");
     VkAttachmentDescription colorAttachment = {};
     colorAttachment.format         = a_swapChainImageFormat;
     colorAttachment.samples        = VK_SAMPLE_COUNT_1_BIT;
@@ -296,29 +806,40 @@ private:
       throw std::runtime_error("[CreateRenderPass]: failed to create render pass!");
   }
 
-  static void CreateGraphicsPipeline(VkDevice a_device, VkExtent2D a_screenExtent, VkRenderPass a_renderPass,
-                                     VkPipelineLayout* a_pLayout, VkPipeline* a_pPipiline)
+  static void CreatePipelineLayout(VkDevice a_device, VkPipelineLayout* a_pLayout)
   {
-    auto vertShaderCode = vk_utils::ReadFile("shaders/vert.spv");
-    auto fragShaderCode = vk_utils::ReadFile("shaders/frag.spv");
-
-    VkShaderModule vertShaderModule = vk_utils::CreateShaderModule(a_device, vertShaderCode);
-    VkShaderModule fragShaderModule = vk_utils::CreateShaderModule(a_device, fragShaderCode);
+    TRACE_SCOPE("CreatePipelineLayout");
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+    pipelineLayoutInfo.sType                  = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount         = 0;
+    pipelineLayoutInfo.pushConstantRangeCount = 0;
 
-    VkPipelineShaderStageCreateInfo vertShaderStageInfo = {};
-    vertShaderStageInfo.sType  = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    vertShaderStageInfo.stage  = VK_SHADER_STAGE_VERTEX_BIT;
-    vertShaderStageInfo.module = vertShaderModule;
-    vertShaderStageInfo.pName  = "main";
+    if (vkCreatePipelineLayout(a_device, &pipelineLayoutInfo, nullptr, a_pLayout) != VK_SUCCESS)
+      throw std::runtime_error("[CreatePipelineLayout]: failed to create pipeline layout!");
+  }
 
-    VkPipelineShaderStageCreateInfo fragShaderStageInfo = {};
-    fragShaderStageInfo.sType  = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    fragShaderStageInfo.stage  = VK_SHADER_STAGE_FRAGMENT_BIT;
-    fragShaderStageInfo.module = fragShaderModule;
-    fragShaderStageInfo.pName  = "main";
+  static std::unique_ptr<vk_utils::MappedFile> MapShaderFile(const char* a_fileName)
+  {
+    std::unique_ptr<vk_utils::MappedFile> pFile(new vk_utils::MappedFile(a_fileName));
+    vk_utils::CheckSpirv(pFile->Data(), pFile->Size(), a_fileName);
+    return pFile;
+  }
 
-    VkPipelineShaderStageCreateInfo shaderStages[] = { vertShaderStageInfo, fragShaderStageInfo };
+  static vk_utils::ShaderRef LoadShader(vk_utils::ShaderModuleCache* a_pCache, const vk_utils::MappedFile* a_pFile, const uint32_t* a_embeddedCode, size_t a_embeddedSize)
+  {
+    if (a_pFile != nullptr)
+      return a_pCache->Acquire((const uint32_t*)a_pFile->Data(), a_pFile->Size());
+    return a_pCache->Acquire(a_embeddedCode, a_embeddedSize);
+  }
 
+  // viewport and scissor are always dynamic, so resolution changes do not need new pipelines
+  //
+  static vk_utils::GraphicsPipelineDesc TrianglePipelineDesc(vk_utils::ShaderRef a_vertShader, vk_utils::ShaderRef a_fragShader,
+                                                             VkRenderPass a_renderPass, VkPipelineLayout a_layout, bool a_extDynamicState)
+  {
+    vk_utils::GraphicsPipelineDesc desc;
+    desc.vertShader = a_vertShader;
+    desc.fragShader = a_fragShader;
 
     VkVertexInputBindingDescription vInputBinding = { };
     vInputBinding.binding   = 0;
@@ -331,105 +852,33 @@ private:
     vAttribute.format   = VK_FORMAT_R32G32_SFLOAT;
     vAttribute.offset   = 0;
 
-    VkPipelineVertexInputStateCreateInfo vertexInputInfo = {};
-    vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    vertexInputInfo.vertexBindingDescriptionCount   = 1;
-    vertexInputInfo.vertexAttributeDescriptionCount = 1;
-    vertexInputInfo.pVertexBindingDescriptions      = &vInputBinding;
-    vertexInputInfo.pVertexAttributeDescriptions    = &vAttribute;
-    
-    VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
-    inputAssembly.sType                  = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-    inputAssembly.topology               = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-    inputAssembly.primitiveRestartEnable = VK_FALSE;
-
-    VkViewport viewport = {};
-    viewport.x        = 0.0f;
-    viewport.y        = 0.0f;
-    viewport.width    = (float)a_screenExtent.width;
-    viewport.height   = (float)a_screenExtent.height;
-    viewport.minDepth = 0.0f;
-    viewport.maxDepth = 1.0f;
-
-    VkRect2D scissor = {};
-    scissor.offset = { 0, 0 };
-    scissor.extent = a_screenExtent;
-
-    VkPipelineViewportStateCreateInfo viewportState = {};
-    viewportState.sType         = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-    viewportState.viewportCount = 1;
-    viewportState.pViewports    = &viewport;
-    viewportState.scissorCount  = 1;
-    viewportState.pScissors     = &scissor;
-
-    VkPipelineRasterizationStateCreateInfo rasterizer = {};
-    rasterizer.sType                   = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-    rasterizer.depthClampEnable        = VK_FALSE;
-    rasterizer.rasterizerDiscardEnable = VK_FALSE;
-    rasterizer.polygonMode             = VK_POLYGON_MODE_FILL;
-    rasterizer.lineWidth               = 1.0f;
-    rasterizer.cullMode                = VK_CULL_MODE_NONE; // VK_CULL_MODE_BACK_BIT;
-    rasterizer.frontFace               = VK_FRONT_FACE_CLOCKWISE;
-    rasterizer.depthBiasEnable         = VK_FALSE;
-
-    VkPipelineMultisampleStateCreateInfo multisampling = {};
-    multisampling.sType                = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-    multisampling.sampleShadingEnable  = VK_FALSE;
-    multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
-
-    VkPipelineColorBlendAttachmentState colorBlendAttachment = {};
-    colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-    colorBlendAttachment.blendEnable    = VK_FALSE;
-
-    VkPipelineColorBlendStateCreateInfo colorBlending = {};
-    colorBlending.sType             = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-    colorBlending.logicOpEnable     = VK_FALSE;
-    colorBlending.logicOp           = VK_LOGIC_OP_COPY;
-    colorBlending.attachmentCount   = 1;
-    colorBlending.pAttachments      = &colorBlendAttachment;
-    colorBlending.blendConstants[0] = 0.0f;
-    colorBlending.blendConstants[1] = 0.0f;
-    colorBlending.blendConstants[2] = 0.0f;
-    colorBlending.blendConstants[3] = 0.0f;
-
-    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
-    pipelineLayoutInfo.sType                  = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipelineLayoutInfo.setLayoutCount         = 0;
-    pipelineLayoutInfo.pushConstantRangeCount = 0;
-
-    if (vkCreatePipelineLayout(a_device, &pipelineLayoutInfo, nullptr, a_pLayout) != VK_SUCCESS)
-      throw std::runtime_error("[CreateGraphicsPipeline]: failed to create pipeline layout!");
-
-    VkGraphicsPipelineCreateInfo pipelineInfo = {};
-    pipelineInfo.sType               = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    pipelineInfo.stageCount          = 2;
-    pipelineInfo.pStages             = shaderStages;
-    pipelineInfo.pVertexInputState   = &vertexInputInfo;
-    pipelineInfo.pInputAssemblyState = &inputAssembly;
-    pipelineInfo.pViewportState      = &viewportState;
-    pipelineInfo.pRasterizationState = &rasterizer;
-    pipelineInfo.pMultisampleState   = &multisampling;
-    pipelineInfo.pColorBlendState    = &colorBlending;
-    pipelineInfo.layout              = (*a_pLayout);
-    pipelineInfo.renderPass          = a_renderPass;
-    pipelineInfo.subpass             = 0;
-    pipelineInfo.basePipelineHandle  = VK_NULL_HANDLE;
+    desc.vertexBindings.push_back(vInputBinding);
+    desc.vertexAttributes.push_back(vAttribute);
 
-    if (vkCreateGraphicsPipelines(a_device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, a_pPipiline) != VK_SUCCESS)
-      throw std::runtime_error("[CreateGraphicsPipeline]: failed to create graphics pipeline!");
+    desc.cullMode       = VK_CULL_MODE_NONE; // VK_CULL_MODE_BACK_BIT;
+    desc.frontFace      = VK_FRONT_FACE_CLOCKWISE;
+    desc.layout         = a_layout;
+    desc.renderPass     = a_renderPass;
+    desc.subpass        = 0;
 
-    vkDestroyShaderModule(a_device, fragShaderModule, nullptr);
-    vkDestroyShaderModule(a_device, vertShaderModule, nullptr);
+    desc.dynamicStates.push_back(VK_DYNAMIC_STATE_VIEWPORT);
+    desc.dynamicStates.push_back(VK_DYNAMIC_STATE_SCISSOR);
+    if (a_extDynamicState)
+    {
+      desc.dynamicStates.push_back(VK_DYNAMIC_STATE_CULL_MODE_EXT);
+      desc.dynamicStates.push_back(VK_DYNAMIC_STATE_FRONT_FACE_EXT);
+      desc.dynamicStates.push_back(VK_DYNAMIC_STATE_PRIMITIVE_TOPOLOGY_EXT);
+    }
+    return desc;
   }
 
-
-  static void CreateAndWriteCommandBuffers(VkDevice a_device, VkCommandPool a_cmdPool, std::vector<VkFramebuffer> a_swapChainFramebuffers, VkExtent2D a_frameBufferExtent,
-                                           VkRenderPass a_renderPass, VkPipeline a_graphicsPipeline, VkBuffer a_vPosBuffer,
-                                           std::vector<VkCommandBuffer>* a_cmdBuffers) 
+  static void CreateCommandBuffers(VkDevice a_device, VkCommandPool a_cmdPool, uint32_t a_count,
+                                   std::vector<VkCommandBuffer>* a_cmdBuffers)
   {
+    TRACE_SCOPE("CreateCommandBuffers");
     std::vector<VkCommandBuffer>& commandBuffers = (*a_cmdBuffers);
 
-    commandBuffers.resize(a_swapChainFramebuffers.size());
+    commandBuffers.resize(a_count);
 
     VkCommandBufferAllocateInfo allocInfo = {};
     allocInfo.sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -438,53 +887,72 @@ private:
     allocInfo.commandBufferCount = (uint32_t)commandBuffers.size();
 
     if (vkAllocateCommandBuffers(a_device, &allocInfo, commandBuffers.data()) != VK_SUCCESS)
-      throw std::runtime_error("[CreateCommandPoolAndBuffers]: failed to allocate command buffers!");
+      throw std::runtime_error("[CreateCommandBuffers]: failed to allocate command buffers!");
+  }
 
-    for (size_t i = 0; i < commandBuffers.size(); i++) 
-    {
-      VkCommandBufferBeginInfo beginInfo = {};
-      beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  // if a_graphicsPipeline is VK_NULL_HANDLE (not compiled yet) the frame is only cleared
+  //
+  static void WriteCommandBuffer(VkCommandBuffer a_cmdBuff, VkFramebuffer a_frameBuffer, VkExtent2D a_frameBufferExtent,
+                                 VkRenderPass a_renderPass, VkPipeline a_graphicsPipeline, const vk_utils::ExtendedDynamicStateFuncs& a_dynamicState,
+                                 VkBuffer a_vPosBuffer)
+  {
+    vkResetCommandBuffer(a_cmdBuff, 0);
 
-      if (vkBeginCommandBuffer(commandBuffers[i], &beginInfo) != VK_SUCCESS) 
-        throw std::runtime_error("[CreateCommandPoolAndBuffers]: failed to begin recording command buffer!");
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
-      VkRenderPassBeginInfo renderPassInfo = {};
-      renderPassInfo.sType             = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-      renderPassInfo.renderPass        = a_renderPass;
-      renderPassInfo.framebuffer       = a_swapChainFramebuffers[i];
-      renderPassInfo.renderArea.offset = { 0, 0 };
-      renderPassInfo.renderArea.extent = a_frameBufferExtent;
+    if (vkBeginCommandBuffer(a_cmdBuff, &beginInfo) != VK_SUCCESS) 
+      throw std::runtime_error("[WriteCommandBuffer]: failed to begin recording command buffer!");
 
-      VkClearValue clearColor = { 0.0f, 0.0f, 0.0f, 1.0f };
-      renderPassInfo.clearValueCount = 1;
-      renderPassInfo.pClearValues = &clearColor;
+    VkRenderPassBeginInfo renderPassInfo = {};
+    renderPassInfo.sType             = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    renderPassInfo.renderPass        = a_renderPass;
+    renderPassInfo.framebuffer       = a_frameBuffer;
+    renderPassInfo.renderArea.offset = { 0, 0 };
+    renderPassInfo.renderArea.extent = a_frameBufferExtent;
 
-      vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+    VkClearValue clearColor = { 0.0f, 0.0f, 0.0f, 1.0f };
+    renderPassInfo.clearValueCount = 1;
+    renderPassInfo.pClearValues = &clearColor;
 
-      vkCmdBindPipeline(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, a_graphicsPipeline);
+    vkCmdBeginRenderPass(a_cmdBuff, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+    if (a_graphicsPipeline != VK_NULL_HANDLE)
+    {
+      vkCmdBindPipeline(a_cmdBuff, VK_PIPELINE_BIND_POINT_GRAPHICS, a_graphicsPipeline);
+      vk_utils::SetViewportAndScissor(a_cmdBuff, a_frameBufferExtent);
+
+      if (a_dynamicState.IsEnabled())
+      {
+        a_dynamicState.vkCmdSetCullModeEXT         (a_cmdBuff, VK_CULL_MODE_NONE); // VK_CULL_MODE_BACK_BIT;
+        a_dynamicState.vkCmdSetFrontFaceEXT        (a_cmdBuff, VK_FRONT_FACE_CLOCKWISE);
+        a_dynamicState.vkCmdSetPrimitiveTopologyEXT(a_cmdBuff, VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
+      }
 
       // say we want to take vertices pos from a_vPosBuffer
       {
         VkBuffer vertexBuffers[] = { a_vPosBuffer };
         VkDeviceSize offsets[]   = { 0 };
-        vkCmdBindVertexBuffers(commandBuffers[i], 0, 1, vertexBuffers, offsets);
+        vkCmdBindVertexBuffers(a_cmdBuff, 0, 1, vertexBuffers, offsets);
       }
 
-      vkCmdDraw(commandBuffers[i], 3, 1, 0, 0);
+      vkCmdDraw(a_cmdBuff, 3, 1, 0, 0);
+    }
 
-      vkCmdEndRenderPass(commandBuffers[i]);
+    vkCmdEndRenderPass(a_cmdBuff);
 
-      if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
-        throw std::runtime_error("failed to record command buffer!");
-      }
+    if (vkEndCommandBuffer(a_cmdBuff) != VK_SUCCESS) {
+      throw std::runtime_error("failed to record command buffer!");
     }
   }
 
-  static void CreateSyncObjects(VkDevice a_device, SyncObj* a_pSyncObjs)
+  static void CreateSyncObjects(VkDevice a_device, uint32_t a_framesInFlight, SyncObj* a_pSyncObjs)
   {
-    a_pSyncObjs->imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    a_pSyncObjs->renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    a_pSyncObjs->inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
+    TRACE_SCOPE("CreateSyncObjects");
+    a_pSyncObjs->imageAvailableSemaphores.resize(a_framesInFlight);
+    a_pSyncObjs->renderFinishedSemaphores.resize(a_framesInFlight);
+    a_pSyncObjs->inFlightFences.resize(a_framesInFlight);
 
     VkSemaphoreCreateInfo semaphoreInfo = {};
     semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
@@ -493,7 +961,7 @@ private:
     fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
     fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
 
-    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) 
+    for (size_t i = 0; i < a_framesInFlight; i++) 
     {
       if (vkCreateSemaphore(a_device, &semaphoreInfo, nullptr, &a_pSyncObjs->imageAvailableSemaphores[i]) != VK_SUCCESS ||
           vkCreateSemaphore(a_device, &semaphoreInfo, nullptr, &a_pSyncObjs->renderFinishedSemaphores[i]) != VK_SUCCESS ||
@@ -503,100 +971,73 @@ private:
     }
   }
 
-  static void CreateVertexBuffer(VkDevice a_device, VkPhysicalDevice a_physDevice, const size_t a_bufferSize,
-                                 VkBuffer *a_pBuffer, VkDeviceMemory *a_pBufferMemory)
+  static vk_utils::AllocatedBuffer* CreateVertexBuffer(vk_utils::DeviceMemoryAllocator* a_pAlloc, const size_t a_bufferSize)
   {
-   
-    VkBufferCreateInfo bufferCreateInfo = {};
-    bufferCreateInfo.sType       = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    bufferCreateInfo.pNext       = nullptr;
-    bufferCreateInfo.size        = a_bufferSize;                         
-    bufferCreateInfo.usage       = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
-    bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;            
-
-    VK_CHECK_RESULT(vkCreateBuffer(a_device, &bufferCreateInfo, NULL, a_pBuffer)); // create bufferStaging.
-
-                
-    VkMemoryRequirements memoryRequirements;
-    vkGetBufferMemoryRequirements(a_device, (*a_pBuffer), &memoryRequirements);
-
-
-    VkMemoryAllocateInfo allocateInfo = {};
-    allocateInfo.sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocateInfo.pNext           = nullptr;
-    allocateInfo.allocationSize  = memoryRequirements.size; // specify required memory.
-    allocateInfo.memoryTypeIndex = vk_utils::FindMemoryType(memoryRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, a_physDevice); // #NOTE VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
-
-    VK_CHECK_RESULT(vkAllocateMemory(a_device, &allocateInfo, NULL, a_pBufferMemory));   // allocate memory on device.
-
-    VK_CHECK_RESULT(vkBindBufferMemory(a_device, (*a_pBuffer), (*a_pBufferMemory), 0));  // Now associate that allocated memory with the bufferStaging. With that, the bufferStaging is backed by actual memory.
-  }
-
-  static void RunCommandBuffer(VkCommandBuffer a_cmdBuff, VkQueue a_queue, VkDevice a_device)
-  {
-    // Now we shall finally submit the recorded command bufferStaging to a queue.
+    // take a piece of some big memory block instead of separate vkAllocateMemory for each buffer and bind it to the buffer.
+    // The allocator owns the buffer, so defragmentation may move it to a more compact place later.
     //
-    VkSubmitInfo submitInfo = {};
-    submitInfo.sType              = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1; // submit a single command bufferStaging
-    submitInfo.pCommandBuffers    = &a_cmdBuff; // the command bufferStaging to submit.
-                                         
-    VkFence fence;
-    VkFenceCreateInfo fenceCreateInfo = {};
-    fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fenceCreateInfo.flags = 0;
-    VK_CHECK_RESULT(vkCreateFence(a_device, &fenceCreateInfo, NULL, &fence));
-
-    // We submit the command bufferStaging on the queue, at the same time giving a fence.
-    //
-    VK_CHECK_RESULT(vkQueueSubmit(a_queue, 1, &submitInfo, fence));
-
-    // The command will not have finished executing until the fence is signalled.
-    // So we wait here. We will directly after this read our bufferStaging from the GPU,
-    // and we will not be sure that the command has finished executing unless we wait for the fence.
-    // Hence, we use a fence here.
-    //
-    VK_CHECK_RESULT(vkWaitForFences(a_device, 1, &fence, VK_TRUE, 100000000000));
-
-    vkDestroyFence(a_device, fence, NULL);
+    return a_pAlloc->CreateBuffer(a_bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, "triangle vertices"); // #NOTE VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
   }
 
   // An example function that immediately copy vertex data to GPU
   //
-  static void PutTriangleVerticesToVBO_Now(VkDevice a_device, VkCommandPool a_pool, VkQueue a_queue, float* a_triPos, int a_floatsNum,
+  static void PutTriangleVerticesToVBO_Now(vk_utils::StagingUploader* a_pUploader, float* a_triPos, int a_floatsNum,
                                            VkBuffer a_buffer)
   {
-    VkCommandBufferAllocateInfo allocInfo = {};
-    allocInfo.sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    allocInfo.commandPool        = a_pool;
-    allocInfo.level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    allocInfo.commandBufferCount = 1;
-
-    VkCommandBuffer cmdBuff;
-    if (vkAllocateCommandBuffers(a_device, &allocInfo, &cmdBuff) != VK_SUCCESS)
-      throw std::runtime_error("[PutTriangleVerticesToVBO_Now]: failed to allocate command buffer!");
-
-    VkCommandBufferBeginInfo beginInfo = {};
-    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT; 
-    
-    vkBeginCommandBuffer(cmdBuff, &beginInfo);
-    vkCmdUpdateBuffer   (cmdBuff, a_buffer, 0, a_floatsNum * sizeof(float), a_triPos);
-    vkEndCommandBuffer  (cmdBuff);
-
-    RunCommandBuffer(cmdBuff, a_queue, a_device);
-
-    vkFreeCommandBuffers(a_device, a_pool, 1, &cmdBuff);
+    TRACE_SCOPE("PutTriangleVerticesToVBO_Now");
+    // data goes through staging memory, so there is no 64 KB limit of vkCmdUpdateBuffer; 
+    // many such updates could be recorded before single WaitIdle() and will end up in one submit.
+    //
+    a_pUploader->UpdateBuffer(a_buffer, 0, a_triPos, a_floatsNum * sizeof(float));
+    a_pUploader->WaitIdle();
   }
 
 
-  void DrawFrame() 
+  bool DrawFrame() // returns false if nothing can be drawn because the window is minimized
   {
+    if (m_swapChainDirty && !RecreateSwapChain())
+      return false;
+
     vkWaitForFences(device, 1, &m_sync.inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
-    vkResetFences  (device, 1, &m_sync.inFlightFences[currentFrame]);
+    ReleaseRetiredScreens();
 
+    // on VK_ERROR_OUT_OF_DATE_KHR neither the semaphore nor the fence is touched, so the same frame slot is simply used again
+    //
     uint32_t imageIndex;
-    vkAcquireNextImageKHR(device, screen.swapChain, UINT64_MAX, m_sync.imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+    const VkResult acquireRes = vkAcquireNextImageKHR(device, screen.swapChain, UINT64_MAX, m_sync.imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+    if (acquireRes == VK_ERROR_OUT_OF_DATE_KHR)
+    {
+      m_swapChainDirty = true;
+      return true;
+    }
+    else if (acquireRes != VK_SUCCESS && acquireRes != VK_SUBOPTIMAL_KHR) // suboptimal image can still be presented
+      throw std::runtime_error("[DrawFrame]: failed to acquire swap chain image!");
+
+    // acquired image is not necessarily free: with 2 images and 2 frames in flight, or when images are returned out of order,
+    // it may still be the target of a frame from another slot. Only that frame is waited for, not all of them.
+    //
+    VkFence& imageFence = m_imagesInFlight[imageIndex];
+    if (imageFence != VK_NULL_HANDLE && imageFence != m_sync.inFlightFences[currentFrame])
+      vkWaitForFences(device, 1, &imageFence, VK_TRUE, UINT64_MAX);
+    imageFence = m_sync.inFlightFences[currentFrame];
+
+    m_pFrameAlloc->BeginFrame(uint32_t(currentFrame), m_sync.inFlightFences[currentFrame]); // GPU is done with this frame data, so we may overwrite it
+    vkResetFences(device, 1, &m_sync.inFlightFences[currentFrame]);
+
+    // a little bit of defragmentation each frame, after the frame fence, so old buffers are released only when unused
+    //
+    if (++m_frameCounter % DEFRAG_PERIOD == 0)
+      m_pDefrag->Start();
+    m_pDefrag->Step();
+
+    if (vk_utils::PipelineCompiler::IsReady(m_pipelineFuture))
+    {
+      graphicsPipeline = m_pipelineFuture.get(); // rethrows if compilation failed; the previous pipeline stays alive in its owner
+      m_pipelineFuture = std::shared_future<VkPipeline>();
+    }
+
+    WriteCommandBuffer(commandBuffers[currentFrame], screen.swapChainFramebuffers[imageIndex], screen.swapChainExtent, renderPass, graphicsPipeline, m_dynamicState, m_pVBO->buffer);
 
     VkSemaphore      waitSemaphores[] = { m_sync.imageAvailableSemaphores[currentFrame] };
     VkPipelineStageFlags waitStages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
@@ -608,7 +1049,7 @@ private:
     submitInfo.pWaitDstStageMask  = waitStages;
 
     submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers    = &commandBuffers[imageIndex];
+    submitInfo.pCommandBuffers    = &commandBuffers[currentFrame];
 
     VkSemaphore signalSemaphores[]  = { m_sync.renderFinishedSemaphores[currentFrame] };
     submitInfo.signalSemaphoreCount = 1;
@@ -616,6 +1057,7 @@ private:
 
     if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, m_sync.inFlightFences[currentFrame]) != VK_SUCCESS)
       throw std::runtime_error("[DrawFrame]: failed to submit draw command buffer!");
+    m_submitCount++;
 
     VkPresentInfoKHR presentInfo = {};
     presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -628,18 +1070,69 @@ private:
     presentInfo.pSwapchains     = swapChains;
     presentInfo.pImageIndices   = &imageIndex;
 
-    vkQueuePresentKHR(presentQueue, &presentInfo);
-    currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+  #if defined(VK_KHR_present_id) && defined(VK_KHR_present_wait)
+    const uint64_t presentId = (m_pPacer != nullptr) ? m_pPacer->NextPresentId() : 0;
+
+    VkPresentIdKHR presentIdInfo = {};
+    presentIdInfo.sType          = VK_STRUCTURE_TYPE_PRESENT_ID_KHR;
+    presentIdInfo.swapchainCount = 1;
+    presentIdInfo.pPresentIds    = &presentId;
+    if (presentId != 0)
+      presentInfo.pNext = &presentIdInfo;
+  #endif
+
+    const VkResult presentRes = vkQueuePresentKHR(presentQueue, &presentInfo);
+    if (m_pPacer != nullptr)
+      m_pPacer->EndFrame();
+    if (presentRes == VK_ERROR_OUT_OF_DATE_KHR || presentRes == VK_SUBOPTIMAL_KHR || acquireRes == VK_SUBOPTIMAL_KHR)
+      m_swapChainDirty = true;
+    else if (presentRes != VK_SUCCESS)
+      throw std::runtime_error("[DrawFrame]: failed to present swap chain image!");
+
+    currentFrame = (currentFrame + 1) % m_framesInFlight;
+    return true;
   }
 
 };
 
-int main() 
+static vk_utils::LATENCY_POLICY ParseLatencyPolicy(const std::string& a_name)
 {
-  HelloTriangleApplication app;
+  if (a_name == "lowest")
+    return vk_utils::LATENCY_POLICY_LOWEST;
+  else if (a_name == "throughput")
+    return vk_utils::LATENCY_POLICY_THROUGHPUT;
+  else if (a_name == "power")
+    return vk_utils::LATENCY_POLICY_POWER_SAVING;
+  throw std::runtime_error("[ParseLatencyPolicy]: unknown latency policy '" + a_name + "', expected lowest, throughput or power");
+}
+
+// without '--latency' or LATENCY_ENV the swap chain prefers MAILBOX with 2 frames in flight, which is the default SwapChainPolicy
+//
+static vk_utils::SwapChainPolicy GetSwapChainPolicy(int argc, char** argv)
+{
+  const char* name = getenv(LATENCY_ENV);
+  if (name != nullptr && name[0] == '\0')
+    name = nullptr;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--latency") != 0)
+      continue;
+    if (i + 1 == argc)
+      throw std::runtime_error("[GetSwapChainPolicy]: '--latency' needs a value: lowest, throughput or power");
+    name = argv[++i];
+  }
 
+  if (name == nullptr)
+    return vk_utils::SwapChainPolicy();
+  return vk_utils::GetSwapChainPolicy(ParseLatencyPolicy(name));
+}
+
+int main(int argc, char** argv) 
+{
   try 
   {
+    HelloTriangleApplication app(GetSwapChainPolicy(argc, argv));
     app.run();
   }
   catch (const std::exception& e) 
@@ -0,0 +1,687 @@
+#include "vk_copy.h"
+#include "vk_trace.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#ifdef WIN32
+#undef min
+#undef max
+#endif
+
+static inline VkDeviceSize AlignUp(VkDeviceSize a_value, VkDeviceSize a_alignment)
+{
+  return (a_value + a_alignment - 1) / a_alignment * a_alignment;
+}
+
+static VkDeviceSize LeastCommonMultiple(VkDeviceSize a, VkDeviceSize b)
+{
+  VkDeviceSize x = a, y = b;
+  while (y != 0)
+  {
+    VkDeviceSize t = x % y;
+    x = y;
+    y = t;
+  }
+  return a / x * b;
+}
+
+vk_utils::ImmediateSubmitPool::ImmediateSubmitPool(VkDevice a_device, VkQueue a_queue, uint32_t a_queueFamilyIndex) :
+                                                   m_device(a_device), m_queue(a_queue), m_queueFamilyIndex(a_queueFamilyIndex), m_nextId(1)
+{
+  VkCommandPoolCreateInfo poolInfo = {};
+  poolInfo.sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  poolInfo.flags            = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  poolInfo.queueFamilyIndex = a_queueFamilyIndex;
+  VK_CHECK_RESULT(vkCreateCommandPool(m_device, &poolInfo, nullptr, &m_cmdPool));
+}
+
+vk_utils::ImmediateSubmitPool::~ImmediateSubmitPool()
+{
+  WaitIdle();
+
+  for (auto fence : m_freeFences)
+    vkDestroyFence(m_device, fence, NULL);
+  vkDestroyCommandPool(m_device, m_cmdPool, NULL); // frees all command buffers as well
+}
+
+VkCommandBuffer vk_utils::ImmediateSubmitPool::BeginCommandBuffer()
+{
+  VkCommandBuffer cmdBuff = VK_NULL_HANDLE;
+
+  if (m_freeCmdBuffs.empty())
+  {
+    VkCommandBufferAllocateInfo allocInfo = {};
+    allocInfo.sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool        = m_cmdPool;
+    allocInfo.level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = 1;
+    VK_CHECK_RESULT(vkAllocateCommandBuffers(m_device, &allocInfo, &cmdBuff));
+  }
+  else
+  {
+    cmdBuff = m_freeCmdBuffs.back();
+    m_freeCmdBuffs.pop_back();
+    VK_CHECK_RESULT(vkResetCommandBuffer(cmdBuff, 0));
+  }
+
+  VkCommandBufferBeginInfo beginInfo = {};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  VK_CHECK_RESULT(vkBeginCommandBuffer(cmdBuff, &beginInfo));
+
+  return cmdBuff;
+}
+
+vk_utils::SubmitToken vk_utils::ImmediateSubmitPool::Submit(VkCommandBuffer a_cmdBuff,
+                                                            uint32_t a_waitCount,   const VkSemaphore* a_pWaitSemaphores, const VkPipelineStageFlags* a_pWaitStages,
+                                                            uint32_t a_signalCount, const VkSemaphore* a_pSignalSemaphores)
+{
+  VK_CHECK_RESULT(vkEndCommandBuffer(a_cmdBuff));
+
+  VkFence fence = VK_NULL_HANDLE;
+  if (m_freeFences.empty())
+  {
+    VkFenceCreateInfo fenceCreateInfo = {};
+    fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fenceCreateInfo.flags = 0;
+    VK_CHECK_RESULT(vkCreateFence(m_device, &fenceCreateInfo, NULL, &fence));
+  }
+  else
+  {
+    fence = m_freeFences.back();
+    m_freeFences.pop_back();
+  }
+
+  VkSubmitInfo submitInfo = {};
+  submitInfo.sType                = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.waitSemaphoreCount   = a_waitCount;
+  submitInfo.pWaitSemaphores      = a_pWaitSemaphores;
+  submitInfo.pWaitDstStageMask    = a_pWaitStages;
+  submitInfo.commandBufferCount   = 1;
+  submitInfo.pCommandBuffers      = &a_cmdBuff;
+  submitInfo.signalSemaphoreCount = a_signalCount;
+  submitInfo.pSignalSemaphores    = a_pSignalSemaphores;
+  VK_CHECK_RESULT(vkQueueSubmit(m_queue, 1, &submitInfo, fence));
+
+  InFlight submit;
+  submit.id      = m_nextId++;
+  submit.cmdBuff = a_cmdBuff;
+  submit.fence   = fence;
+  m_inFlight.push_back(submit);
+
+  SubmitToken token;
+  token.id = submit.id;
+  return token;
+}
+
+void vk_utils::ImmediateSubmitPool::Recycle(std::deque<InFlight>::iterator a_it)
+{
+  VK_CHECK_RESULT(vkResetFences(m_device, 1, &a_it->fence));
+  m_freeFences.push_back(a_it->fence);
+  m_freeCmdBuffs.push_back(a_it->cmdBuff);
+  m_inFlight.erase(a_it);
+}
+
+bool vk_utils::ImmediateSubmitPool::IsComplete(SubmitToken a_token)
+{
+  bool found = false;
+  for (auto p = m_inFlight.begin(); p != m_inFlight.end();)
+  {
+    if (p->id > a_token.id) // submits after the token don't matter
+      break;
+
+    if (vkGetFenceStatus(m_device, p->fence) == VK_SUCCESS)
+    {
+      Recycle(p);
+      p = m_inFlight.begin(); // erase invalidates deque iterators; the list is short
+      continue;
+    }
+
+    found = found || (p->id == a_token.id);
+    ++p;
+  }
+  return !found;
+}
+
+void vk_utils::ImmediateSubmitPool::Wait(SubmitToken a_token)
+{
+  for (auto p = m_inFlight.begin(); p != m_inFlight.end(); ++p)
+  {
+    if (p->id == a_token.id)
+    {
+      VK_CHECK_RESULT(vkWaitForFences(m_device, 1, &p->fence, VK_TRUE, UINT64_MAX));
+      Recycle(p);
+      break;
+    }
+  }
+}
+
+void vk_utils::ImmediateSubmitPool::WaitIdle()
+{
+  while (!m_inFlight.empty())
+  {
+    VK_CHECK_RESULT(vkWaitForFences(m_device, 1, &m_inFlight.front().fence, VK_TRUE, UINT64_MAX));
+    Recycle(m_inFlight.begin());
+  }
+}
+
+vk_utils::StagingUploader::StagingUploader(DeviceMemoryAllocator* a_pAlloc, VkQueue a_queue, uint32_t a_queueFamilyIndex, VkDeviceSize a_ringSize) :
+                                           StagingUploader(a_pAlloc, a_queue, a_queueFamilyIndex, a_queue, a_queueFamilyIndex, a_ringSize)
+{
+
+}
+
+vk_utils::StagingUploader::StagingUploader(DeviceMemoryAllocator* a_pAlloc, VkQueue a_transferQueue, uint32_t a_transferFamily, VkQueue a_dstQueue, uint32_t a_dstFamily,
+                                           VkDeviceSize a_ringSize) :
+                                           m_device(a_pAlloc->GetDevice()), m_submitPool(a_pAlloc->GetDevice(), a_transferQueue, a_transferFamily), m_cmdBuff(VK_NULL_HANDLE),
+                                           m_transferFamily(a_transferFamily), m_dstFamily(a_dstFamily),
+                                           m_pAlloc(a_pAlloc), m_ringSize(a_ringSize), m_ringHead(0), m_ringTail(0)
+{
+  TRACE_SCOPE("StagingUploader");
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(a_pAlloc->GetPhysicalDevice(), &props);
+  m_copyAlignment = std::max(props.limits.optimalBufferCopyOffsetAlignment, VkDeviceSize(16));
+
+  uint32_t queueFamilyCount = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(a_pAlloc->GetPhysicalDevice(), &queueFamilyCount, NULL);
+  std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+  vkGetPhysicalDeviceQueueFamilyProperties(a_pAlloc->GetPhysicalDevice(), &queueFamilyCount, queueFamilies.data());
+  m_imageGranularity = queueFamilies[a_transferFamily].minImageTransferGranularity;
+
+  if (a_transferFamily != a_dstFamily)
+    m_pAcquirePool.reset(new ImmediateSubmitPool(m_device, a_dstQueue, a_dstFamily));
+
+  VkBufferCreateInfo bufferCreateInfo = {};
+  bufferCreateInfo.sType       = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferCreateInfo.pNext       = nullptr;
+  bufferCreateInfo.size        = a_ringSize;
+  bufferCreateInfo.usage       = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+  bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  VK_CHECK_RESULT(vkCreateBuffer(m_device, &bufferCreateInfo, NULL, &m_ringBuffer));
+  m_ringMem = a_pAlloc->AllocateAndBindBuffer(m_ringBuffer, vk_utils::GetMemoryTypeRequest(MEMORY_USAGE_STAGING), "StagingUploader ring");
+}
+
+vk_utils::StagingUploader::~StagingUploader()
+{
+  WaitIdle();
+
+  for (auto semaphore : m_freeSemaphores)
+    vkDestroySemaphore(m_device, semaphore, NULL);
+
+  vkDestroyBuffer(m_device, m_ringBuffer, NULL);
+  m_pAlloc->Free(m_ringMem);
+}
+
+bool vk_utils::StagingUploader::IsBatchComplete(const Batch& a_batch)
+{
+  if (m_pAcquirePool != nullptr && !m_pAcquirePool->IsComplete(a_batch.acquireToken))
+    return false;
+  return m_submitPool.IsComplete(a_batch.token); // also recycles transfer command buffer
+}
+
+void vk_utils::StagingUploader::RetireBatch(bool a_wait)
+{
+  Batch& batch = m_batches.front();
+  if (a_wait)
+  {
+    if (m_pAcquirePool != nullptr)
+      m_pAcquirePool->Wait(batch.acquireToken);
+    m_submitPool.Wait(batch.token);
+  }
+
+  if (batch.semaphore != VK_NULL_HANDLE)
+    m_freeSemaphores.push_back(batch.semaphore);
+
+  m_ringTail = std::max(m_ringTail, batch.ringEnd);
+  m_batches.pop_front();
+}
+
+void vk_utils::StagingUploader::ReleaseCompleted()
+{
+  while (!m_batches.empty() && IsBatchComplete(m_batches.front()))
+    RetireBatch(false);
+}
+
+void vk_utils::StagingUploader::WaitBufferCopies(VkBuffer a_dst)
+{
+  if (std::find(m_recordedBuffers.begin(), m_recordedBuffers.end(), a_dst) != m_recordedBuffers.end())
+    Flush();
+
+  // batches are retired oldest first, so everything up to the last one that writes a_dst is waited for
+  //
+  size_t batchesToWait = 0;
+  for (size_t i = 0; i < m_batches.size(); i++)
+  {
+    const auto& dstBuffers = m_batches[i].dstBuffers;
+    if (std::find(dstBuffers.begin(), dstBuffers.end(), a_dst) != dstBuffers.end())
+      batchesToWait = i + 1;
+  }
+
+  for (size_t i = 0; i < batchesToWait; i++)
+    RetireBatch(true);
+}
+
+VkCommandBuffer vk_utils::StagingUploader::CurrentCmdBuffer()
+{
+  if (m_cmdBuff == VK_NULL_HANDLE)
+    m_cmdBuff = m_submitPool.BeginCommandBuffer();
+  return m_cmdBuff;
+}
+
+VkDeviceSize vk_utils::StagingUploader::AllocateStaging(VkDeviceSize a_size, VkDeviceSize a_minSize, VkDeviceSize a_alignment, VkDeviceSize* a_pGotSize)
+{
+  // a_minSize is also a granularity: the returned piece is always a multiple of it (or the whole a_size)
+  //
+  if (a_minSize > m_ringSize)
+    RUN_TIME_ERROR("[StagingUploader]: staging ring is too small for a single piece of data");
+
+  while (true)
+  {
+    // the offset inside of the ring is aligned, not the absolute head: alignment (e.g. 12 for RGB32F texels) may not divide the ring size
+    //
+    const VkDeviceSize headPos = m_ringHead % m_ringSize;
+    VkDeviceSize       ringPos = AlignUp(headPos, a_alignment);
+    VkDeviceSize       head    = m_ringHead + (ringPos - headPos);
+
+    if (ringPos > m_ringSize || m_ringSize - ringPos < a_minSize) // the rest of the ring can't hold even the smallest piece, skip to the beginning
+    {
+      head    = m_ringHead + (m_ringSize - headPos);
+      ringPos = 0;
+    }
+    const VkDeviceSize untilWrap = m_ringSize - ringPos;
+
+    const VkDeviceSize freeBytes = (m_ringTail + m_ringSize > head) ? (m_ringTail + m_ringSize - head) : 0;
+    const VkDeviceSize available = std::min(untilWrap, freeBytes);
+
+    if (available >= a_minSize)
+    {
+      (*a_pGotSize) = (a_size <= available) ? a_size : (available / a_minSize) * a_minSize;
+      m_ringHead    = head + (*a_pGotSize);
+      return ringPos;
+    }
+
+    // ring is full: release finished batches first, if none, submit what we have and wait for the oldest one
+    //
+    const VkDeviceSize oldTail = m_ringTail;
+    ReleaseCompleted();
+    if (m_ringTail != oldTail)
+      continue;
+
+    Flush();
+
+    if (!m_batches.empty())
+      RetireBatch(true);
+    else // nothing is in flight, the whole ring is free; start from its beginning
+    {
+      m_ringHead = AlignUp(m_ringHead, m_ringSize);
+      m_ringTail = m_ringHead;
+    }
+  }
+}
+
+void vk_utils::StagingUploader::UpdateBuffer(VkBuffer a_dst, VkDeviceSize a_dstOffset, const void* a_src, VkDeviceSize a_size)
+{
+  if (a_size == 0) // nothing to copy, and a zero sized barrier range would be invalid
+    return;
+
+  const char*        src        = (const char*)a_src;
+  const VkDeviceSize fullOffset = a_dstOffset;
+  const VkDeviceSize fullSize   = a_size;
+
+  while (a_size > 0)
+  {
+    VkDeviceSize chunkSize = 0;
+    VkDeviceSize ringPos   = AllocateStaging(a_size, std::min(a_size, m_copyAlignment), m_copyAlignment, &chunkSize);
+
+    memcpy((char*)m_ringMem.mapped + ringPos, src, size_t(chunkSize));
+
+    VkBufferCopy region = {};
+    region.srcOffset = ringPos;
+    region.dstOffset = a_dstOffset;
+    region.size      = chunkSize;
+    vkCmdCopyBuffer(CurrentCmdBuffer(), m_ringBuffer, a_dst, 1, &region);
+    if (std::find(m_recordedBuffers.begin(), m_recordedBuffers.end(), a_dst) == m_recordedBuffers.end())
+      m_recordedBuffers.push_back(a_dst);
+
+    src         += chunkSize;
+    a_dstOffset += chunkSize;
+    a_size      -= chunkSize;
+  }
+
+  if (m_pAcquirePool != nullptr) // release the range to the destination queue family; acquire is recorded by Flush
+  {
+    VkBufferMemoryBarrier barrier = {};
+    barrier.sType               = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask       = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask       = 0;
+    barrier.srcQueueFamilyIndex = m_transferFamily;
+    barrier.dstQueueFamilyIndex = m_dstFamily;
+    barrier.buffer              = a_dst;
+    barrier.offset              = fullOffset;
+    barrier.size                = fullSize;
+    vkCmdPipelineBarrier(CurrentCmdBuffer(), VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+    m_acquireBuffers.push_back(barrier);
+  }
+}
+
+void vk_utils::StagingUploader::UpdateBuffer(VkBuffer a_dst, const MemAllocation& a_dstMem, VkDeviceSize a_dstOffset, const void* a_src, VkDeviceSize a_size)
+{
+  if (a_size == 0)
+    return;
+
+  // device local and host visible memory (resizable BAR) does not need staging copy at all
+  //
+  if (a_dstMem.mapped != nullptr && (a_dstMem.memProps & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
+  {
+    WaitBufferCopies(a_dst); // otherwise an earlier staged copy to the same range would overwrite this write later
+    memcpy((char*)a_dstMem.mapped + a_dstOffset, a_src, size_t(a_size));
+  }
+  else
+    UpdateBuffer(a_dst, a_dstOffset, a_src, a_size);
+}
+
+void vk_utils::StagingUploader::UpdateImage(VkImage a_dst, VkImageAspectFlags a_aspect, VkExtent3D a_extent, uint32_t a_texelSize, const void* a_src,
+                                            VkImageLayout a_finalLayout)
+{
+  VkImageMemoryBarrier barrier = {};
+  barrier.sType                           = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.srcQueueFamilyIndex             = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex             = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image                           = a_dst;
+  barrier.subresourceRange.aspectMask     = a_aspect;
+  barrier.subresourceRange.baseMipLevel   = 0;
+  barrier.subresourceRange.levelCount     = 1;
+  barrier.subresourceRange.baseArrayLayer = 0;
+  barrier.subresourceRange.layerCount     = 1;
+
+  barrier.srcAccessMask = 0;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.oldLayout     = VK_IMAGE_LAYOUT_UNDEFINED;
+  barrier.newLayout     = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  vkCmdPipelineBarrier(CurrentCmdBuffer(), VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+  // image is split by rows, so one row must fit the ring; bufferOffset must be a multiple of both texel size and 4.
+  // Transfer-only queues may also require offsets and extents to be multiples of minImageTransferGranularity
+  // (zero granularity means whole image only).
+  //
+  const bool wholeSlices = (m_imageGranularity.width == 0 || m_imageGranularity.height == 0);
+  if (a_extent.depth > 1 && m_imageGranularity.depth != 1)
+    RUN_TIME_ERROR("[StagingUploader::UpdateImage]: 3D images on queues with depth transfer granularity are not supported");
+
+  const uint32_t     unitRows  = wholeSlices ? a_extent.height : m_imageGranularity.height;
+  const VkDeviceSize rowSize   = VkDeviceSize(a_extent.width)*a_texelSize;
+  const VkDeviceSize alignment = LeastCommonMultiple(LeastCommonMultiple(a_texelSize, 4), m_copyAlignment);
+  const char*        src       = (const char*)a_src;
+
+  for (uint32_t z = 0; z < a_extent.depth; z++)
+  {
+    uint32_t row = 0;
+    while (row < a_extent.height)
+    {
+      const VkDeviceSize restSize  = rowSize*(a_extent.height - row);
+      const VkDeviceSize unitSize  = rowSize*std::min(unitRows, a_extent.height - row);
+      VkDeviceSize       chunkSize = 0;
+      VkDeviceSize       ringPos   = AllocateStaging(restSize, unitSize, alignment, &chunkSize);
+      const uint32_t     rows      = uint32_t(chunkSize / rowSize);
+
+      memcpy((char*)m_ringMem.mapped + ringPos, src, size_t(rows*rowSize));
+
+      VkBufferImageCopy region = {};
+      region.bufferOffset                    = ringPos;
+      region.bufferRowLength                 = 0; // tightly packed
+      region.bufferImageHeight               = 0; //
+      region.imageSubresource.aspectMask     = a_aspect;
+      region.imageSubresource.mipLevel       = 0;
+      region.imageSubresource.baseArrayLayer = 0;
+      region.imageSubresource.layerCount     = 1;
+      region.imageOffset                     = { 0, int32_t(row), int32_t(z) };
+      region.imageExtent                     = { a_extent.width, rows, 1 };
+      vkCmdCopyBufferToImage(CurrentCmdBuffer(), m_ringBuffer, a_dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+      src += rows*rowSize;
+      row += rows;
+    }
+  }
+
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+  barrier.oldLayout     = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barrier.newLayout     = a_finalLayout;
+
+  if (m_pAcquirePool == nullptr)
+  {
+    vkCmdPipelineBarrier(CurrentCmdBuffer(), VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+    return;
+  }
+
+  // release and acquire barriers must have the same layouts, so layout transition happens once during ownership transfer
+  //
+  barrier.dstAccessMask       = 0;
+  barrier.srcQueueFamilyIndex = m_transferFamily;
+  barrier.dstQueueFamilyIndex = m_dstFamily;
+  vkCmdPipelineBarrier(CurrentCmdBuffer(), VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+  barrier.srcAccessMask = 0;
+  barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+  m_acquireImages.push_back(barrier);
+}
+
+vk_utils::SubmitToken vk_utils::StagingUploader::Flush()
+{
+  if (m_cmdBuff == VK_NULL_HANDLE)
+  {
+    if (m_batches.empty())
+      return SubmitToken();
+    return m_pAcquirePool ? m_batches.back().acquireToken : m_batches.back().token;
+  }
+
+  Batch batch;
+  batch.semaphore = VK_NULL_HANDLE;
+  batch.ringEnd   = m_ringHead;
+  batch.dstBuffers.swap(m_recordedBuffers);
+
+  if (m_pAcquirePool == nullptr)
+  {
+    // make transfer writes visible to everything that will be executed on this queue later
+    //
+    VkMemoryBarrier barrier = {};
+    barrier.sType         = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+    vkCmdPipelineBarrier(m_cmdBuff, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    batch.token = m_submitPool.Submit(m_cmdBuff);
+  }
+  else
+  {
+    if (m_freeSemaphores.empty())
+    {
+      VkSemaphoreCreateInfo semaphoreInfo = {};
+      semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+      VK_CHECK_RESULT(vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &batch.semaphore));
+    }
+    else
+    {
+      batch.semaphore = m_freeSemaphores.back();
+      m_freeSemaphores.pop_back();
+    }
+
+    batch.token = m_submitPool.Submit(m_cmdBuff, 0, nullptr, nullptr, 1, &batch.semaphore);
+
+    // later submits to the destination queue are ordered after this one, and its barriers cover ALL_COMMANDS
+    //
+    VkCommandBuffer      acquireCmd = m_pAcquirePool->BeginCommandBuffer();
+    VkPipelineStageFlags waitStage  = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+    if (!m_acquireBuffers.empty() || !m_acquireImages.empty())
+      vkCmdPipelineBarrier(acquireCmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr,
+                           uint32_t(m_acquireBuffers.size()), m_acquireBuffers.data(), uint32_t(m_acquireImages.size()), m_acquireImages.data());
+    batch.acquireToken = m_pAcquirePool->Submit(acquireCmd, 1, &batch.semaphore, &waitStage);
+
+    m_acquireBuffers.clear();
+    m_acquireImages.clear();
+  }
+
+  m_batches.push_back(batch);
+  m_cmdBuff = VK_NULL_HANDLE;
+
+  return m_pAcquirePool ? batch.acquireToken : batch.token;
+}
+
+void vk_utils::StagingUploader::WaitIdle()
+{
+  Flush();
+  while (!m_batches.empty())
+    RetireBatch(true);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+vk_utils::MemoryDefragmenter::MemoryDefragmenter(DeviceMemoryAllocator* a_pAlloc, VkQueue a_queue, uint32_t a_queueFamilyIndex, uint32_t a_framesInFlight) :
+                                                 m_pAlloc(a_pAlloc), m_submitPool(a_pAlloc->GetDevice(), a_queue, a_queueFamilyIndex), m_framesInFlight(a_framesInFlight),
+                                                 m_active(false), m_stepId(0)
+{
+
+}
+
+vk_utils::MemoryDefragmenter::~MemoryDefragmenter()
+{
+  m_submitPool.WaitIdle();
+
+  // copies were not applied, so the new buffers are just dropped
+  //
+  for (auto& move : m_inFlight)
+  {
+    m_pAlloc->CancelMove(move.bufferId);
+    vkDestroyBuffer(m_pAlloc->GetDevice(), move.dst.buffer, NULL);
+    m_pAlloc->Free(move.dst.memory);
+  }
+  m_inFlight.clear();
+
+  ReleaseRetired(true);
+  if (m_active)
+    m_pAlloc->EndDefragmentation();
+}
+
+uint32_t vk_utils::MemoryDefragmenter::Start(float a_maxOccupancy)
+{
+  if (m_active)
+    return 0;
+
+  const uint32_t blocks = m_pAlloc->BeginDefragmentation(a_maxOccupancy, &m_pending);
+  m_active = (blocks != 0);
+  if (!m_active)
+    m_pAlloc->EndDefragmentation();
+  return blocks;
+}
+
+void vk_utils::MemoryDefragmenter::ReleaseRetired(bool a_all)
+{
+  while (!m_retired.empty() && (a_all || m_retired.front().releaseStep <= m_stepId))
+  {
+    vkDestroyBuffer(m_pAlloc->GetDevice(), m_retired.front().old.buffer, NULL);
+    m_pAlloc->Free(m_retired.front().old.memory); // the last one in a block releases the block
+    m_retired.pop_front();
+  }
+}
+
+bool vk_utils::MemoryDefragmenter::Step(VkDeviceSize a_maxBytes)
+{
+  m_stepId++;
+  ReleaseRetired(false);
+
+  if (!m_active)
+    return false;
+
+  // (1) apply finished copies; frames recorded before this point may still use old buffers, so they are kept for a while
+  //
+  if (!m_inFlight.empty())
+  {
+    if (!m_submitPool.IsComplete(m_copyToken))
+      return true;
+
+    for (auto& move : m_inFlight)
+    {
+      AllocatedBuffer* pBuffer = m_pAlloc->EndMove(move.bufferId, &move.dst);
+
+      Retired retired;
+      retired.old         = move.dst;
+      retired.releaseStep = m_stepId + m_framesInFlight;
+      m_retired.push_back(retired);
+
+      if (pBuffer != nullptr && m_moveCallback)
+        m_moveCallback(pBuffer, retired.old.buffer);
+    }
+    m_inFlight.clear();
+  }
+
+  // blocks stay marked until old buffers are released, otherwise new allocations could land there and keep them alive
+  //
+  if (m_pending.empty())
+  {
+    if (!m_retired.empty())
+      return true;
+
+    m_pAlloc->EndDefragmentation();
+    m_active = false;
+    return false;
+  }
+
+  // (2) copy next portion of buffers with a single submit
+  //
+  VkCommandBuffer cmdBuff = VK_NULL_HANDLE;
+  VkDeviceSize    bytes   = 0;
+
+  while (!m_pending.empty() && bytes < a_maxBytes)
+  {
+    Move     move;
+    VkBuffer srcBuffer = VK_NULL_HANDLE;
+    move.bufferId = m_pending.back();
+    m_pending.pop_back();
+
+    if (!m_pAlloc->BeginMove(move.bufferId, &move.dst, &srcBuffer))
+      continue;
+
+    if (cmdBuff == VK_NULL_HANDLE)
+    {
+      cmdBuff = m_submitPool.BeginCommandBuffer();
+
+      // previous GPU writes to the buffers must be finished before we read them
+      //
+      VkMemoryBarrier barrier = {};
+      barrier.sType         = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+      barrier.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+      barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+      vkCmdPipelineBarrier(cmdBuff, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+    }
+
+    VkBufferCopy region = {};
+    region.srcOffset = 0;
+    region.dstOffset = 0;
+    region.size      = move.dst.size;
+    vkCmdCopyBuffer(cmdBuff, srcBuffer, move.dst.buffer, 1, &region);
+
+    bytes += move.dst.size;
+    m_inFlight.push_back(move);
+  }
+
+  if (cmdBuff != VK_NULL_HANDLE)
+  {
+    VkMemoryBarrier barrier = {};
+    barrier.sType         = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+    vkCmdPipelineBarrier(cmdBuff, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    m_copyToken = m_submitPool.Submit(cmdBuff);
+  }
+
+  return true;
+}
@@ -0,0 +1,221 @@
+#ifndef VULKAN_MINIMAL_GRAPHICS_VK_COPY_H
+#define VULKAN_MINIMAL_GRAPHICS_VK_COPY_H
+
+#include <vulkan/vulkan.h>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+
+#include "vk_utils.h"
+#include "vk_memory.h"
+
+namespace vk_utils
+{
+  struct SubmitToken
+  {
+    uint64_t id = 0; // 0 means nothing was submitted, such token is always complete
+  };
+
+  /**
+  \brief Recycles command buffers and fences for one-shot submissions.
+
+  Instead of creating a fence and a command buffer for every immediate submit, both are taken from free lists
+  and returned there when the submission is complete. Submit returns a token that can be polled with IsComplete
+  or waited with Wait, so the caller may keep working while the GPU runs.
+  Not thread safe (command pool must be externally synchronized); use one pool per thread.
+  */
+  class ImmediateSubmitPool
+  {
+  public:
+
+    ImmediateSubmitPool(VkDevice a_device, VkQueue a_queue, uint32_t a_queueFamilyIndex);
+    ~ImmediateSubmitPool();
+
+    ImmediateSubmitPool(const ImmediateSubmitPool& a_rhs)            = delete;
+    ImmediateSubmitPool& operator=(const ImmediateSubmitPool& a_rhs) = delete;
+
+    VkCommandBuffer BeginCommandBuffer(); // returns a command buffer that is already in recording state
+
+    SubmitToken Submit(VkCommandBuffer a_cmdBuff,  // ends recording and submits
+                       uint32_t a_waitCount = 0,   const VkSemaphore* a_pWaitSemaphores = nullptr, const VkPipelineStageFlags* a_pWaitStages = nullptr,
+                       uint32_t a_signalCount = 0, const VkSemaphore* a_pSignalSemaphores = nullptr);
+
+    bool IsComplete(SubmitToken a_token); // never blocks
+    void Wait(SubmitToken a_token);
+    void WaitIdle();
+
+    VkQueue  GetQueue()            const { return m_queue; }
+    uint32_t GetQueueFamilyIndex() const { return m_queueFamilyIndex; }
+
+  private:
+
+    struct InFlight
+    {
+      uint64_t        id;
+      VkCommandBuffer cmdBuff;
+      VkFence         fence;
+    };
+
+    void Recycle(std::deque<InFlight>::iterator a_it);
+
+    VkDevice      m_device;
+    VkQueue       m_queue;
+    uint32_t      m_queueFamilyIndex;
+    VkCommandPool m_cmdPool;
+
+    std::vector<VkCommandBuffer> m_freeCmdBuffs;
+    std::vector<VkFence>         m_freeFences;
+    std::deque<InFlight>         m_inFlight; // sorted by id
+    uint64_t                     m_nextId;
+  };
+
+  /**
+  \brief Uploads buffers and images of any size through a reusable ring of host visible staging memory.
+
+  Copies are recorded to the current batch command buffer; many UpdateBuffer/UpdateImage calls end up in one submit.
+  When the ring is full, the current batch is submitted and the oldest batch is waited for, so uploads that are
+  bigger than the whole ring are split into several pieces across ring wraps.
+  A batch ends with a barrier that makes transfer writes visible to all later commands on the same queue.
+  Command buffers and fences of batches are recycled by ImmediateSubmitPool.
+
+  If copies run on a dedicated transfer queue of another family, every uploaded range is released by the transfer
+  queue and acquired by the destination queue: Flush submits copies with a semaphore signal and a small command buffer
+  with acquire barriers on the destination queue that waits for it. Work submitted to the destination queue after
+  Flush sees the data, while copies themselves overlap with rendering. Destination resources must use
+  VK_SHARING_MODE_EXCLUSIVE; a partially updated buffer keeps the rest of its content on all known drivers, but the
+  spec only guarantees the updated range.
+  Not thread safe.
+  */
+  class StagingUploader
+  {
+  public:
+
+    static const VkDeviceSize DEFAULT_RING_SIZE = VkDeviceSize(16*1024*1024);
+
+    StagingUploader(DeviceMemoryAllocator* a_pAlloc, VkQueue a_queue, uint32_t a_queueFamilyIndex, VkDeviceSize a_ringSize = DEFAULT_RING_SIZE);
+    StagingUploader(DeviceMemoryAllocator* a_pAlloc, VkQueue a_transferQueue, uint32_t a_transferFamily, VkQueue a_dstQueue, uint32_t a_dstFamily,
+                    VkDeviceSize a_ringSize = DEFAULT_RING_SIZE);
+    ~StagingUploader();
+
+    StagingUploader(const StagingUploader& a_rhs)            = delete;
+    StagingUploader& operator=(const StagingUploader& a_rhs) = delete;
+
+    void UpdateBuffer(VkBuffer a_dst, VkDeviceSize a_dstOffset, const void* a_src, VkDeviceSize a_size);
+    void UpdateBuffer(VkBuffer a_dst, const MemAllocation& a_dstMem, VkDeviceSize a_dstOffset, const void* a_src, VkDeviceSize a_size); // writes directly if a_dstMem is mapped,
+                                                                                                                                          // after staged copies to a_dst are finished
+
+    // mip level 0 and layer 0 only; image is transitioned from UNDEFINED layout to a_finalLayout, so old content is discarded.
+    //
+    void UpdateImage(VkImage a_dst, VkImageAspectFlags a_aspect, VkExtent3D a_extent, uint32_t a_texelSize, const void* a_src,
+                     VkImageLayout a_finalLayout);
+
+    SubmitToken Flush();    // submit all recorded copies, does not wait; the token belongs to the destination queue
+    bool        IsComplete(SubmitToken a_token) { return m_pAcquirePool ? m_pAcquirePool->IsComplete(a_token) : m_submitPool.IsComplete(a_token); }
+    void        WaitIdle(); // submit all recorded copies and wait for all of them
+
+  private:
+
+    struct Batch
+    {
+      SubmitToken           token;        // copies on the transfer queue
+      SubmitToken           acquireToken; // acquire barriers on the destination queue, if it is of another family
+      VkSemaphore           semaphore;    // transfer -> destination queue handoff
+      VkDeviceSize          ringEnd;      // ring head when the batch was submitted; everything before is free when the batch is complete
+      std::vector<VkBuffer> dstBuffers;   // written by UpdateBuffer copies of the batch
+    };
+
+    VkCommandBuffer CurrentCmdBuffer();
+    VkDeviceSize    AllocateStaging(VkDeviceSize a_size, VkDeviceSize a_minSize, VkDeviceSize a_alignment, VkDeviceSize* a_pGotSize); // returns ring offset
+    bool            IsBatchComplete(const Batch& a_batch);
+    void            RetireBatch(bool a_wait); // oldest one
+    void            ReleaseCompleted();
+    void            WaitBufferCopies(VkBuffer a_dst); // submits and waits for batches that copy to a_dst
+
+    VkDevice              m_device;
+    ImmediateSubmitPool   m_submitPool;
+    VkCommandBuffer       m_cmdBuff;         // batch that is being recorded now
+    std::vector<VkBuffer> m_recordedBuffers; // its dstBuffers
+    std::deque<Batch>     m_batches;         // submitted batches, oldest first
+
+    uint32_t                             m_transferFamily;
+    uint32_t                             m_dstFamily;
+    VkExtent3D                           m_imageGranularity; // minImageTransferGranularity of transfer family
+    std::unique_ptr<ImmediateSubmitPool> m_pAcquirePool;     // null if both queues are of the same family
+    std::vector<VkBufferMemoryBarrier>   m_acquireBuffers;   // barriers released by the current batch
+    std::vector<VkImageMemoryBarrier>    m_acquireImages;    //
+    std::vector<VkSemaphore>             m_freeSemaphores;
+
+    DeviceMemoryAllocator* m_pAlloc;
+    VkBuffer               m_ringBuffer;
+    MemAllocation          m_ringMem;
+    VkDeviceSize           m_ringSize;
+    VkDeviceSize           m_ringHead; // both head and tail only grow, actual offset is (x % m_ringSize)
+    VkDeviceSize           m_ringTail;
+    VkDeviceSize           m_copyAlignment;
+  };
+
+  /**
+  \brief Incremental defragmentation of buffers created with DeviceMemoryAllocator::CreateBuffer.
+
+  Start marks sparsely used blocks (all allocations movable, occupancy not above the threshold) for evacuation.
+  Each Step, called once per frame after waiting for the frame fence, copies up to a_maxBytes of live buffers
+  to other blocks with one GPU submit, and on the next Step (when the copy is complete) swaps handles inside of
+  AllocatedBuffer and calls the move callback, so the application can rewrite descriptors and command buffers.
+  Old buffers are destroyed 'a_framesInFlight' steps later, when no frame can use them anymore; then empty blocks
+  are released by the allocator.
+  Moved buffers must not be written by GPU or CPU while their copy is in flight; they may be destroyed at any time,
+  the allocator then keeps the source alive until the copy is finished. Not thread safe.
+  */
+  class MemoryDefragmenter
+  {
+  public:
+
+    typedef std::function<void(AllocatedBuffer* a_pBuffer, VkBuffer a_oldBuffer)> MoveCallback;
+
+    static const VkDeviceSize DEFAULT_BYTES_PER_STEP = VkDeviceSize(8*1024*1024);
+
+    MemoryDefragmenter(DeviceMemoryAllocator* a_pAlloc, VkQueue a_queue, uint32_t a_queueFamilyIndex, uint32_t a_framesInFlight);
+    ~MemoryDefragmenter();
+
+    MemoryDefragmenter(const MemoryDefragmenter& a_rhs)            = delete;
+    MemoryDefragmenter& operator=(const MemoryDefragmenter& a_rhs) = delete;
+
+    void SetMoveCallback(MoveCallback a_callback) { m_moveCallback = a_callback; }
+
+    uint32_t Start(float a_maxOccupancy = 0.5f); // returns number of blocks to evacuate; does nothing if a pass is active
+    bool     Step(VkDeviceSize a_maxBytes = DEFAULT_BYTES_PER_STEP); // returns true while the pass is active
+    bool     IsActive() const { return m_active; }
+
+  private:
+
+    struct Move
+    {
+      uint64_t        bufferId;
+      AllocatedBuffer dst; // new buffer and memory; old ones after EndMove
+    };
+
+    struct Retired
+    {
+      AllocatedBuffer old;
+      uint64_t        releaseStep;
+    };
+
+    void ReleaseRetired(bool a_all);
+
+    DeviceMemoryAllocator*        m_pAlloc;
+    ImmediateSubmitPool           m_submitPool;
+    uint32_t                      m_framesInFlight;
+    MoveCallback                  m_moveCallback;
+
+    bool                          m_active;
+    uint64_t                      m_stepId;
+    std::vector<uint64_t>         m_pending;  // ids of buffers still to be moved
+    std::vector<Move>             m_inFlight; // copied by the last submit
+    SubmitToken                   m_copyToken;
+    std::deque<Retired>           m_retired;
+  };
+
+};
+
+#endif //VULKAN_MINIMAL_GRAPHICS_VK_COPY_H
@@ -0,0 +1,1110 @@
+#include "vk_memory.h"
+#include "vk_trace.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <string>
+#include <string.h>
+
+#include <algorithm>
+#ifdef WIN32
+#undef min
+#undef max
+#endif
+
+struct vk_utils::MemBlock
+{
+  struct Chunk
+  {
+    VkDeviceSize  size;
+    SUBALLOC_KIND kind;
+    uint64_t      ownerHandle; // VkBuffer or VkImage, for residency report only
+    std::string   debugName;   //
+  };
+
+  VkDeviceMemory memory;
+  VkDeviceSize   size;
+  uint32_t       memTypeId;
+  void*          mapped;
+  bool           dedicated;
+  bool           evacuating; // defragmentation moves everything out of it, new allocations go elsewhere
+
+  VkDeviceSize   usedBytes;
+  uint32_t       allocCount;
+
+  std::map<VkDeviceSize, Chunk>             chunks;     // all ranges of the block, free and used, sorted by offset
+  std::multimap<VkDeviceSize, VkDeviceSize> freeBySize; // free list: size --> offset
+};
+
+static inline VkDeviceSize AlignUp(VkDeviceSize a_value, VkDeviceSize a_alignment)
+{
+  return (a_value + a_alignment - 1) / a_alignment * a_alignment;
+}
+
+// Two resources of different kind must not share a 'page' of bufferImageGranularity size
+//
+static inline bool OnSamePage(VkDeviceSize a_offsetA, VkDeviceSize a_sizeA, VkDeviceSize a_offsetB, VkDeviceSize a_pageSize)
+{
+  const VkDeviceSize endA   = a_offsetA + a_sizeA - 1;
+  const VkDeviceSize pageA  = endA      & ~(a_pageSize - 1);
+  const VkDeviceSize pageB  = a_offsetB & ~(a_pageSize - 1);
+  return pageA == pageB;
+}
+
+static inline bool KindsConflict(vk_utils::SUBALLOC_KIND a, vk_utils::SUBALLOC_KIND b)
+{
+  if (a == vk_utils::SUBALLOC_FREE || b == vk_utils::SUBALLOC_FREE)
+    return false;
+  return (a == vk_utils::SUBALLOC_IMAGE_OPTIMAL) != (b == vk_utils::SUBALLOC_IMAGE_OPTIMAL);
+}
+
+static void EraseFromFreeList(vk_utils::MemBlock* a_pBlock, VkDeviceSize a_size, VkDeviceSize a_offset)
+{
+  auto range = a_pBlock->freeBySize.equal_range(a_size);
+  for (auto p = range.first; p != range.second; ++p)
+  {
+    if (p->second == a_offset)
+    {
+      a_pBlock->freeBySize.erase(p);
+      return;
+    }
+  }
+  assert(false);
+}
+
+vk_utils::DeviceMemoryAllocator::DeviceMemoryAllocator(VkDevice a_device, VkPhysicalDevice a_physDevice, VkDeviceSize a_blockSize) :
+                                                       m_device(a_device), m_physDevice(a_physDevice), m_blockSize(a_blockSize), m_allocationCount(0),
+                                                       m_nextBufferId(1), m_pfnGetMemProps2(nullptr), m_blockOpsSinceSnapshot(0), m_highWaterMark(1.0f)
+{
+  TRACE_SCOPE("DeviceMemoryAllocator");
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(a_physDevice, &props);
+  m_memProps = vk_utils::GetMemoryProperties(a_physDevice);
+
+  m_granularity        = std::max(props.limits.bufferImageGranularity, VkDeviceSize(1));
+  m_maxAllocationCount = props.limits.maxMemoryAllocationCount;
+
+  for (uint32_t heapId = 0; heapId < VK_MAX_MEMORY_HEAPS; heapId++)
+  {
+    m_heapBlockBytes[heapId] = 0;
+    m_aboveMark     [heapId] = false;
+  }
+  UpdateBudgetSnapshot();
+}
+
+vk_utils::DeviceMemoryAllocator::~DeviceMemoryAllocator()
+{
+  for (uint32_t typeId = 0; typeId < VK_MAX_MEMORY_TYPES; typeId++)
+  {
+    for (auto pBlock : m_blocks[typeId])
+    {
+      if (pBlock->allocCount != 0)
+        std::cout << "[DeviceMemoryAllocator]: warning, " << pBlock->allocCount << " allocations were not freed in memory type " << typeId << std::endl;
+      DestroyBlock(pBlock);
+    }
+    m_blocks[typeId].clear();
+  }
+}
+
+vk_utils::MemBlock* vk_utils::DeviceMemoryAllocator::CreateBlock(uint32_t a_memTypeId, VkDeviceSize a_size, bool a_dedicated)
+{
+  if (m_allocationCount >= m_maxAllocationCount)
+    RUN_TIME_ERROR("[DeviceMemoryAllocator::CreateBlock]: maxMemoryAllocationCount exceeded");
+
+  VkMemoryAllocateInfo allocateInfo = {};
+  allocateInfo.sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocateInfo.pNext           = nullptr;
+  allocateInfo.allocationSize  = a_size;
+  allocateInfo.memoryTypeIndex = a_memTypeId;
+
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  if (vkAllocateMemory(m_device, &allocateInfo, NULL, &memory) != VK_SUCCESS)
+    return nullptr;
+
+  MemBlock* pBlock   = new MemBlock;
+  pBlock->memory     = memory;
+  pBlock->size       = a_size;
+  pBlock->memTypeId  = a_memTypeId;
+  pBlock->mapped     = nullptr;
+  pBlock->dedicated  = a_dedicated;
+  pBlock->evacuating = false;
+  pBlock->usedBytes  = 0;
+  pBlock->allocCount = 0;
+
+  MemBlock::Chunk whole = { a_size, SUBALLOC_FREE };
+  pBlock->chunks[0] = whole;
+  pBlock->freeBySize.insert(std::make_pair(a_size, VkDeviceSize(0)));
+
+  // map host visible blocks once for their whole life time
+  //
+  if (m_memProps.memoryTypes[a_memTypeId].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+    VK_CHECK_RESULT(vkMapMemory(m_device, memory, 0, a_size, 0, &pBlock->mapped));
+
+  m_blocks[a_memTypeId].push_back(pBlock);
+  m_allocationCount++;
+  m_heapBlockBytes[m_memProps.memoryTypes[a_memTypeId].heapIndex] += a_size;
+  m_blockOpsSinceSnapshot++;
+  return pBlock;
+}
+
+void vk_utils::DeviceMemoryAllocator::DestroyBlock(MemBlock* a_pBlock)
+{
+  if (a_pBlock->mapped != nullptr)
+    vkUnmapMemory(m_device, a_pBlock->memory);
+  vkFreeMemory(m_device, a_pBlock->memory, NULL);
+  m_allocationCount--;
+  m_heapBlockBytes[m_memProps.memoryTypes[a_pBlock->memTypeId].heapIndex] -= a_pBlock->size;
+  m_blockOpsSinceSnapshot++;
+  delete a_pBlock;
+}
+
+bool vk_utils::DeviceMemoryAllocator::TryAllocateInBlock(MemBlock* a_pBlock, VkDeviceSize a_size, VkDeviceSize a_alignment, SUBALLOC_KIND a_kind,
+                                                         VkDeviceSize* a_pOffset)
+{
+  // best fit: walk free ranges from the smallest one that can hold the allocation
+  //
+  for (auto p = a_pBlock->freeBySize.lower_bound(a_size); p != a_pBlock->freeBySize.end(); ++p)
+  {
+    const VkDeviceSize freeOffset = p->second;
+    const VkDeviceSize freeSize   = p->first;
+
+    auto chunkIt = a_pBlock->chunks.find(freeOffset);
+    assert(chunkIt != a_pBlock->chunks.end());
+
+    VkDeviceSize offset = AlignUp(freeOffset, a_alignment);
+
+    // free ranges are always merged, so both neighbours (if any) are used
+    //
+    if (m_granularity > 1 && chunkIt != a_pBlock->chunks.begin())
+    {
+      auto prev = chunkIt; --prev;
+      if (KindsConflict(prev->second.kind, a_kind) && OnSamePage(prev->first, prev->second.size, offset, m_granularity))
+        offset = AlignUp(offset, m_granularity);
+    }
+
+    if (offset + a_size > freeOffset + freeSize)
+      continue;
+
+    if (m_granularity > 1)
+    {
+      auto next = chunkIt; ++next;
+      if (next != a_pBlock->chunks.end() && KindsConflict(next->second.kind, a_kind) && OnSamePage(offset, a_size, next->first, m_granularity))
+        continue;
+    }
+
+    // split the free range to [padding, allocation, tail]
+    //
+    a_pBlock->freeBySize.erase(p);
+    a_pBlock->chunks.erase(chunkIt);
+
+    if (offset > freeOffset)
+    {
+      MemBlock::Chunk padding = { offset - freeOffset, SUBALLOC_FREE };
+      a_pBlock->chunks[freeOffset] = padding;
+      a_pBlock->freeBySize.insert(std::make_pair(padding.size, freeOffset));
+    }
+
+    MemBlock::Chunk used = { a_size, a_kind };
+    a_pBlock->chunks[offset] = used;
+
+    const VkDeviceSize tailOffset = offset + a_size;
+    const VkDeviceSize tailSize   = freeOffset + freeSize - tailOffset;
+    if (tailSize > 0)
+    {
+      MemBlock::Chunk tail = { tailSize, SUBALLOC_FREE };
+      a_pBlock->chunks[tailOffset] = tail;
+      a_pBlock->freeBySize.insert(std::make_pair(tailSize, tailOffset));
+    }
+
+    a_pBlock->usedBytes += a_size;
+    a_pBlock->allocCount++;
+    (*a_pOffset) = offset;
+    return true;
+  }
+
+  return false;
+}
+
+void vk_utils::DeviceMemoryAllocator::FreeInBlock(MemBlock* a_pBlock, VkDeviceSize a_offset)
+{
+  auto chunkIt = a_pBlock->chunks.find(a_offset);
+  if (chunkIt == a_pBlock->chunks.end() || chunkIt->second.kind == SUBALLOC_FREE)
+    RUN_TIME_ERROR("[DeviceMemoryAllocator::Free]: invalid or double free");
+
+  a_pBlock->usedBytes -= chunkIt->second.size;
+  a_pBlock->allocCount--;
+
+  VkDeviceSize offset = chunkIt->first;
+  VkDeviceSize size   = chunkIt->second.size;
+
+  // merge with free neighbours
+  //
+  auto next = chunkIt; ++next;
+  if (next != a_pBlock->chunks.end() && next->second.kind == SUBALLOC_FREE)
+  {
+    EraseFromFreeList(a_pBlock, next->second.size, next->first);
+    size += next->second.size;
+    a_pBlock->chunks.erase(next);
+  }
+
+  if (chunkIt != a_pBlock->chunks.begin())
+  {
+    auto prev = chunkIt; --prev;
+    if (prev->second.kind == SUBALLOC_FREE)
+    {
+      EraseFromFreeList(a_pBlock, prev->second.size, prev->first);
+      offset = prev->first;
+      size  += prev->second.size;
+      a_pBlock->chunks.erase(chunkIt);
+      chunkIt = prev;
+    }
+  }
+
+  chunkIt->second.size        = size;
+  chunkIt->second.kind        = SUBALLOC_FREE;
+  chunkIt->second.ownerHandle = 0;
+  chunkIt->second.debugName.clear();
+  a_pBlock->freeBySize.insert(std::make_pair(size, offset));
+}
+
+vk_utils::MemBlock* vk_utils::DeviceMemoryAllocator::AllocateInType(uint32_t a_memTypeId, VkDeviceSize a_size, VkDeviceSize a_alignment, SUBALLOC_KIND a_kind,
+                                                                    VkDeviceSize* a_pOffset, bool a_allowNewBlock)
+{
+  if (a_size <= m_blockSize/2)
+  {
+    for (auto pCurr : m_blocks[a_memTypeId])
+    {
+      if (!pCurr->dedicated && !pCurr->evacuating && TryAllocateInBlock(pCurr, a_size, a_alignment, a_kind, a_pOffset))
+        return pCurr;
+    }
+
+    if (!a_allowNewBlock)
+      return nullptr;
+
+    MemBlock* pBlock = CreateBlock(a_memTypeId, m_blockSize, false);
+    if (pBlock != nullptr)
+    {
+      if (!TryAllocateInBlock(pBlock, a_size, a_alignment, a_kind, a_pOffset))
+        RUN_TIME_ERROR("[DeviceMemoryAllocator::Allocate]: unexpected failure in a new block");
+      return pBlock;
+    }
+  }
+
+  if (!a_allowNewBlock)
+    return nullptr;
+
+  // big allocations (or no space left for a whole new block) go to a dedicated vkAllocateMemory
+  //
+  MemBlock* pBlock = CreateBlock(a_memTypeId, a_size, true);
+  if (pBlock != nullptr)
+    TryAllocateInBlock(pBlock, a_size, 1, a_kind, a_pOffset);
+  return pBlock;
+}
+
+vk_utils::MemAllocation vk_utils::DeviceMemoryAllocator::Allocate(const VkMemoryRequirements& a_memReq, const MemoryTypeRequest& a_request, SUBALLOC_KIND a_kind)
+{
+  const std::vector<uint32_t> candidates = vk_utils::GetMemoryTypeCandidates(a_memReq.memoryTypeBits, a_request, m_physDevice);
+  if (candidates.empty())
+    RUN_TIME_ERROR("[DeviceMemoryAllocator::Allocate]: can't find suitable memory type");
+
+  const VkDeviceSize alignment = std::max(a_memReq.alignment, VkDeviceSize(1));
+
+  MemBlock*    pBlock    = nullptr;
+  VkDeviceSize offset    = 0;
+  uint32_t     blockOps  = 0;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    blockOps = m_blockOpsSinceSnapshot;
+
+    for (auto memTypeId : candidates)
+    {
+      pBlock = AllocateInType(memTypeId, a_memReq.size, alignment, a_kind, &offset);
+      if (pBlock != nullptr)
+        break;
+    }
+
+    blockOps = m_blockOpsSinceSnapshot - blockOps;
+  }
+
+  if (blockOps != 0) // usage changes only when blocks are created or destroyed
+    CheckHighWaterMark();
+
+  if (pBlock == nullptr)
+    RUN_TIME_ERROR("[DeviceMemoryAllocator::Allocate]: vkAllocateMemory failed, out of device memory");
+
+  MemAllocation res;
+  res.memory    = pBlock->memory;
+  res.offset    = offset;
+  res.size      = a_memReq.size;
+  res.memTypeId = pBlock->memTypeId;
+  res.memProps  = m_memProps.memoryTypes[pBlock->memTypeId].propertyFlags;
+  res.mapped    = (pBlock->mapped == nullptr) ? nullptr : (void*)((char*)pBlock->mapped + offset);
+  res.pBlock    = pBlock;
+  return res;
+}
+
+void vk_utils::DeviceMemoryAllocator::Free(const MemAllocation& a_alloc)
+{
+  if (a_alloc.pBlock == nullptr)
+    return;
+
+  bool blockDestroyed = false;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    MemBlock* pBlock = a_alloc.pBlock;
+    FreeInBlock(pBlock, a_alloc.offset);
+
+    if (pBlock->allocCount != 0)
+      return;
+
+    // release empty blocks, but keep the last shared block of each type to avoid allocation ping-pong
+    //
+    auto& blocks = m_blocks[pBlock->memTypeId];
+    size_t sharedBlocks = 0;
+    for (auto pCurr : blocks)
+      sharedBlocks += pCurr->dedicated ? 0 : 1;
+
+    if (pBlock->dedicated || sharedBlocks > 1)
+    {
+      blocks.erase(std::find(blocks.begin(), blocks.end(), pBlock));
+      DestroyBlock(pBlock);
+      blockDestroyed = true;
+    }
+  }
+
+  if (blockDestroyed) // re-arm high-water mark of this heap if usage went down
+    CheckHighWaterMark();
+}
+
+vk_utils::MemAllocation vk_utils::DeviceMemoryAllocator::AllocateAndBindBuffer(VkBuffer a_buffer, const MemoryTypeRequest& a_request, const char* a_debugName)
+{
+  VkMemoryRequirements memoryRequirements;
+  vkGetBufferMemoryRequirements(m_device, a_buffer, &memoryRequirements);
+
+  MemAllocation alloc = Allocate(memoryRequirements, a_request, SUBALLOC_BUFFER);
+  VK_CHECK_RESULT(vkBindBufferMemory(m_device, a_buffer, alloc.memory, alloc.offset));
+  SetDebugInfo(alloc, (uint64_t)(a_buffer), a_debugName);
+  return alloc;
+}
+
+vk_utils::MemAllocation vk_utils::DeviceMemoryAllocator::AllocateAndBindImage(VkImage a_image, VkImageTiling a_tiling, const MemoryTypeRequest& a_request,
+                                                                              const char* a_debugName)
+{
+  VkMemoryRequirements memoryRequirements;
+  vkGetImageMemoryRequirements(m_device, a_image, &memoryRequirements);
+
+  const SUBALLOC_KIND kind = (a_tiling == VK_IMAGE_TILING_OPTIMAL) ? SUBALLOC_IMAGE_OPTIMAL : SUBALLOC_IMAGE_LINEAR;
+
+  MemAllocation alloc = Allocate(memoryRequirements, a_request, kind);
+  VK_CHECK_RESULT(vkBindImageMemory(m_device, a_image, alloc.memory, alloc.offset));
+  SetDebugInfo(alloc, (uint64_t)(a_image), a_debugName);
+  return alloc;
+}
+
+vk_utils::AllocatedBuffer* vk_utils::DeviceMemoryAllocator::CreateBuffer(VkDeviceSize a_size, VkBufferUsageFlags a_usage, const MemoryTypeRequest& a_request,
+                                                                          const char* a_debugName)
+{
+  VkBufferCreateInfo bufferCreateInfo = {};
+  bufferCreateInfo.sType       = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferCreateInfo.pNext       = nullptr;
+  bufferCreateInfo.size        = a_size;
+  bufferCreateInfo.usage       = a_usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT; // defragmentation copies buffers
+  bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  AllocatedBuffer* pBuffer = new AllocatedBuffer;
+  pBuffer->size  = a_size;
+  pBuffer->usage = bufferCreateInfo.usage;
+
+  VK_CHECK_RESULT(vkCreateBuffer(m_device, &bufferCreateInfo, NULL, &pBuffer->buffer));
+  pBuffer->memory  = AllocateAndBindBuffer(pBuffer->buffer, a_request, a_debugName);
+  pBuffer->movable = (pBuffer->memory.mapped == nullptr); // CPU may keep the mapped pointer
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  pBuffer->id = m_nextBufferId++;
+  m_buffers[pBuffer->id] = pBuffer;
+  return pBuffer;
+}
+
+void vk_utils::DeviceMemoryAllocator::DestroyBuffer(AllocatedBuffer* a_pBuffer)
+{
+  if (a_pBuffer == nullptr)
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_buffers.erase(a_pBuffer->id);
+
+    // a defragmentation copy may still read the buffer, so it is released by EndMove or CancelMove
+    //
+    if (m_moving.erase(a_pBuffer->id) != 0)
+    {
+      m_orphanMoves[a_pBuffer->id] = *a_pBuffer;
+      delete a_pBuffer;
+      return;
+    }
+  }
+
+  vkDestroyBuffer(m_device, a_pBuffer->buffer, NULL);
+  Free(a_pBuffer->memory);
+  delete a_pBuffer;
+}
+
+uint32_t vk_utils::DeviceMemoryAllocator::BeginDefragmentation(float a_maxOccupancy, std::vector<uint64_t>* a_pToMove)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  // a block may be emptied only if everything inside of it can be moved
+  //
+  std::map<MemBlock*, std::vector<uint64_t> > movableInBlock;
+  for (const auto& buffer : m_buffers)
+  {
+    if (buffer.second->movable)
+      movableInBlock[buffer.second->memory.pBlock].push_back(buffer.first);
+  }
+
+  a_pToMove->clear();
+  uint32_t evacuated = 0;
+
+  for (uint32_t typeId = 0; typeId < m_memProps.memoryTypeCount; typeId++)
+  {
+    std::vector<MemBlock*> sparse;
+    VkDeviceSize           freeInOthers = 0;
+
+    for (auto pBlock : m_blocks[typeId])
+    {
+      if (pBlock->dedicated)
+        continue;
+
+      auto p = movableInBlock.find(pBlock);
+      const size_t movable = (p == movableInBlock.end()) ? 0 : p->second.size();
+
+      if (movable != 0 && movable == pBlock->allocCount && double(pBlock->usedBytes) <= double(pBlock->size)*a_maxOccupancy)
+        sparse.push_back(pBlock);
+      else
+        freeInOthers += pBlock->size - pBlock->usedBytes;
+    }
+
+    // empty the sparsest blocks first, while their data fits to the rest; moves that don't fit due to fragmentation are just skipped later
+    //
+    std::sort(sparse.begin(), sparse.end(), [](const MemBlock* a, const MemBlock* b) { return a->usedBytes < b->usedBytes; });
+
+    for (size_t i = 0; i < sparse.size(); i++)
+    {
+      MemBlock* pBlock = sparse[i];
+      if (pBlock->usedBytes > freeInOthers)
+      {
+        for (size_t j = i; j < sparse.size(); j++) // the rest stay and become destinations
+          freeInOthers += sparse[j]->size - sparse[j]->usedBytes;
+        continue;
+      }
+
+      freeInOthers      -= pBlock->usedBytes;
+      pBlock->evacuating = true;
+      evacuated++;
+
+      const auto& buffers = movableInBlock[pBlock];
+      a_pToMove->insert(a_pToMove->end(), buffers.begin(), buffers.end());
+    }
+  }
+
+  return evacuated;
+}
+
+bool vk_utils::DeviceMemoryAllocator::BeginMove(uint64_t a_bufferId, AllocatedBuffer* a_pDst, VkBuffer* a_pSrc)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  // buffer could be destroyed (or pinned) after BeginDefragmentation
+  //
+  auto p = m_buffers.find(a_bufferId);
+  if (p == m_buffers.end() || m_moving.count(a_bufferId) != 0)
+    return false;
+
+  AllocatedBuffer* pBuffer = p->second;
+  if (!pBuffer->movable || !pBuffer->memory.pBlock->evacuating)
+    return false;
+
+  VkBufferCreateInfo bufferCreateInfo = {};
+  bufferCreateInfo.sType       = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferCreateInfo.size        = pBuffer->size;
+  bufferCreateInfo.usage       = pBuffer->usage;
+  bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  VkBuffer newBuffer = VK_NULL_HANDLE;
+  VK_CHECK_RESULT(vkCreateBuffer(m_device, &bufferCreateInfo, NULL, &newBuffer));
+
+  VkMemoryRequirements memReq;
+  vkGetBufferMemoryRequirements(m_device, newBuffer, &memReq);
+
+  const uint32_t memTypeId = pBuffer->memory.memTypeId;
+  VkDeviceSize   offset    = 0;
+  MemBlock*      pBlock    = nullptr;
+  if (memReq.memoryTypeBits & (1u << memTypeId))
+    pBlock = AllocateInType(memTypeId, memReq.size, std::max(memReq.alignment, VkDeviceSize(1)), SUBALLOC_BUFFER, &offset, false);
+
+  if (pBlock == nullptr) // no space in the remaining blocks; moving to a new block would not save anything
+  {
+    vkDestroyBuffer(m_device, newBuffer, NULL);
+    return false;
+  }
+
+  a_pDst->buffer           = newBuffer;
+  a_pDst->size             = pBuffer->size;
+  a_pDst->usage            = pBuffer->usage;
+  a_pDst->memory           = pBuffer->memory;
+  a_pDst->memory.memory    = pBlock->memory;
+  a_pDst->memory.offset    = offset;
+  a_pDst->memory.size      = memReq.size;
+  a_pDst->memory.pBlock    = pBlock;
+  a_pDst->memory.mapped    = nullptr;
+  VK_CHECK_RESULT(vkBindBufferMemory(m_device, newBuffer, pBlock->memory, offset));
+
+  MemBlock::Chunk& newChunk = pBlock->chunks[offset];
+  newChunk.ownerHandle      = (uint64_t)(newBuffer);
+  newChunk.debugName        = pBuffer->memory.pBlock->chunks[pBuffer->memory.offset].debugName;
+
+  m_moving.insert(a_bufferId);
+  *a_pSrc = pBuffer->buffer;
+  return true;
+}
+
+vk_utils::AllocatedBuffer* vk_utils::DeviceMemoryAllocator::EndMove(uint64_t a_bufferId, AllocatedBuffer* a_pDst)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_moving.erase(a_bufferId) != 0)
+    {
+      AllocatedBuffer* pBuffer = m_buffers[a_bufferId];
+      std::swap(pBuffer->buffer, a_pDst->buffer);
+      std::swap(pBuffer->memory, a_pDst->memory);
+      pBuffer->generation++;
+      return pBuffer;
+    }
+  }
+
+  CancelMove(a_bufferId); // destroyed while copy was in flight, so the copy is garbage
+  return nullptr;
+}
+
+void vk_utils::DeviceMemoryAllocator::CancelMove(uint64_t a_bufferId)
+{
+  AllocatedBuffer orphan;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_moving.erase(a_bufferId);
+
+    auto p = m_orphanMoves.find(a_bufferId);
+    if (p == m_orphanMoves.end())
+      return;
+    orphan = p->second;
+    m_orphanMoves.erase(p);
+  }
+
+  vkDestroyBuffer(m_device, orphan.buffer, NULL);
+  Free(orphan.memory);
+}
+
+void vk_utils::DeviceMemoryAllocator::EndDefragmentation()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (uint32_t typeId = 0; typeId < m_memProps.memoryTypeCount; typeId++)
+  {
+    for (auto pBlock : m_blocks[typeId])
+      pBlock->evacuating = false;
+  }
+}
+
+void vk_utils::DeviceMemoryAllocator::GetHeapUsage(std::vector<HeapUsage>* a_pUsage) const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  a_pUsage->clear();
+  a_pUsage->resize(m_memProps.memoryHeapCount);
+  for (uint32_t heapId = 0; heapId < m_memProps.memoryHeapCount; heapId++)
+    (*a_pUsage)[heapId].heapSize = m_memProps.memoryHeaps[heapId].size;
+
+  for (uint32_t typeId = 0; typeId < m_memProps.memoryTypeCount; typeId++)
+  {
+    HeapUsage& usage = (*a_pUsage)[m_memProps.memoryTypes[typeId].heapIndex];
+    for (auto pBlock : m_blocks[typeId])
+    {
+      usage.blockBytes      += pBlock->size;
+      usage.allocationBytes += pBlock->usedBytes;
+      usage.blockCount      += 1;
+      usage.allocationCount += pBlock->allocCount;
+    }
+  }
+}
+
+void vk_utils::DeviceMemoryAllocator::PrintHeapUsage() const
+{
+  std::vector<HeapUsage> usage;
+  GetHeapUsage(&usage);
+
+  std::cout << "DeviceMemoryAllocator: { " << std::endl;
+  for (size_t heapId = 0; heapId < usage.size(); heapId++)
+  {
+    std::cout << "  heap " << heapId << ": blocks = " << usage[heapId].blockCount << " (" << usage[heapId].blockBytes/1024 << " KB), "
+              << "allocations = " << usage[heapId].allocationCount << " (" << usage[heapId].allocationBytes/1024 << " KB), "
+              << "heap size = " << usage[heapId].heapSize/(1024*1024) << " MB" << std::endl;
+  }
+  std::cout << "}" << std::endl;
+}
+
+void vk_utils::DeviceMemoryAllocator::SetDebugInfo(const MemAllocation& a_alloc, uint64_t a_ownerHandle, const char* a_debugName)
+{
+  if (a_alloc.pBlock == nullptr)
+    return;
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  auto chunkIt = a_alloc.pBlock->chunks.find(a_alloc.offset);
+  if (chunkIt == a_alloc.pBlock->chunks.end() || chunkIt->second.kind == SUBALLOC_FREE)
+    RUN_TIME_ERROR("[DeviceMemoryAllocator::SetDebugInfo]: invalid allocation");
+
+  chunkIt->second.ownerHandle = a_ownerHandle;
+  chunkIt->second.debugName   = (a_debugName == nullptr) ? "" : a_debugName;
+}
+
+static void WriteJsonString(std::ostream& a_out, const std::string& a_str)
+{
+  a_out << '"';
+  for (char c : a_str)
+  {
+    if (c == '"' || c == '\\')
+      a_out << '\\' << c;
+    else if ((unsigned char)c < 0x20)
+    {
+      char buff[8];
+      snprintf(buff, sizeof(buff), "\\u%04x", (unsigned)c);
+      a_out << buff;
+    }
+    else
+      a_out << c;
+  }
+  a_out << '"';
+}
+
+static const char* OwnerTypeName(vk_utils::SUBALLOC_KIND a_kind, uint64_t a_handle)
+{
+  if (a_handle == 0)
+    return "raw";
+  return (a_kind == vk_utils::SUBALLOC_BUFFER) ? "buffer" : "image";
+}
+
+void vk_utils::DeviceMemoryAllocator::WriteResidencyReport(std::ostream& a_out) const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  a_out << "{" << std::endl;
+  a_out << "  \"heaps\": [" << std::endl;
+  for (uint32_t heapId = 0; heapId < m_memProps.memoryHeapCount; heapId++)
+  {
+    const HeapBudget budget = EstimateBudget(heapId);
+    a_out << "    { \"index\": " << heapId << ", \"size\": " << budget.heapSize << ", \"flags\": " << m_memProps.memoryHeaps[heapId].flags
+          << ", \"budget\": " << budget.budget << ", \"usage\": " << budget.usage << ", \"blockBytes\": " << budget.blockBytes << " }"
+          << ((heapId + 1 < m_memProps.memoryHeapCount) ? "," : "") << std::endl;
+  }
+  a_out << "  ]," << std::endl;
+
+  a_out << "  \"memoryTypes\": [" << std::endl;
+  for (uint32_t typeId = 0; typeId < m_memProps.memoryTypeCount; typeId++)
+  {
+    a_out << "    { \"index\": " << typeId << ", \"heap\": " << m_memProps.memoryTypes[typeId].heapIndex
+          << ", \"flags\": " << m_memProps.memoryTypes[typeId].propertyFlags << " }" << ((typeId + 1 < m_memProps.memoryTypeCount) ? "," : "") << std::endl;
+  }
+  a_out << "  ]," << std::endl;
+
+  a_out << "  \"blocks\": [";
+  bool firstBlock = true;
+  for (uint32_t typeId = 0; typeId < m_memProps.memoryTypeCount; typeId++)
+  {
+    for (const MemBlock* pBlock : m_blocks[typeId])
+    {
+      // fragmentation is 0 when all free memory is one range and goes to 1 when it is split to many small ones
+      //
+      VkDeviceSize freeBytes = 0, largestFree = 0;
+      uint32_t     freeRanges = 0;
+      for (const auto& chunk : pBlock->chunks)
+      {
+        if (chunk.second.kind != SUBALLOC_FREE)
+          continue;
+        freeBytes  += chunk.second.size;
+        largestFree = std::max(largestFree, chunk.second.size);
+        freeRanges++;
+      }
+      const double fragmentation = (freeBytes == 0) ? 0.0 : 1.0 - double(largestFree)/double(freeBytes);
+
+      a_out << (firstBlock ? "" : ",") << std::endl;
+      a_out << "    {" << std::endl;
+      a_out << "      \"memoryType\": " << typeId << ", \"heap\": " << m_memProps.memoryTypes[typeId].heapIndex << ", \"size\": " << pBlock->size
+            << ", \"dedicated\": " << (pBlock->dedicated ? "true" : "false") << "," << std::endl;
+      a_out << "      \"usedBytes\": " << pBlock->usedBytes << ", \"allocationCount\": " << pBlock->allocCount << ", \"freeBytes\": " << freeBytes
+            << ", \"freeRanges\": " << freeRanges << ", \"largestFreeRange\": " << largestFree << ", \"fragmentation\": " << fragmentation << "," << std::endl;
+      a_out << "      \"allocations\": [";
+
+      bool firstAlloc = true;
+      for (const auto& chunk : pBlock->chunks)
+      {
+        if (chunk.second.kind == SUBALLOC_FREE)
+          continue;
+
+        char handle[32];
+        snprintf(handle, sizeof(handle), "0x%016llx", (unsigned long long)chunk.second.ownerHandle);
+
+        a_out << (firstAlloc ? "" : ",") << std::endl;
+        a_out << "        { \"offset\": " << chunk.first << ", \"size\": " << chunk.second.size << ", \"owner\": \"" << OwnerTypeName(chunk.second.kind, chunk.second.ownerHandle)
+              << "\", \"handle\": \"" << handle << "\", \"name\": ";
+        WriteJsonString(a_out, chunk.second.debugName);
+        a_out << " }";
+        firstAlloc = false;
+      }
+      a_out << (firstAlloc ? "]" : "\n      ]") << std::endl;
+      a_out << "    }";
+      firstBlock = false;
+    }
+  }
+  a_out << (firstBlock ? "]" : "\n  ]") << std::endl;
+  a_out << "}" << std::endl;
+}
+
+bool vk_utils::DeviceMemoryAllocator::SaveResidencyReport(const char* a_fileName) const
+{
+  std::ofstream fout(a_fileName);
+  if (!fout.is_open())
+  {
+    std::cout << "[DeviceMemoryAllocator]: can't open " << a_fileName << " for residency report" << std::endl;
+    return false;
+  }
+  WriteResidencyReport(fout);
+  return true;
+}
+
+void vk_utils::DeviceMemoryAllocator::EnableMemoryBudgetExt(VkInstance a_instance)
+{
+  TRACE_SCOPE("DeviceMemoryAllocator::EnableMemoryBudgetExt");
+  // instance is created with apiVersion 1.0, so the function comes from VK_KHR_get_physical_device_properties2
+  //
+  auto pfn = (PFN_vkGetPhysicalDeviceMemoryProperties2KHR)vkGetInstanceProcAddr(a_instance, "vkGetPhysicalDeviceMemoryProperties2KHR");
+  if (pfn == nullptr)
+    std::cout << "[DeviceMemoryAllocator]: warning, vkGetPhysicalDeviceMemoryProperties2KHR is not available, using own accounting" << std::endl;
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_pfnGetMemProps2 = pfn;
+  UpdateBudgetSnapshot();
+}
+
+void vk_utils::DeviceMemoryAllocator::UpdateBudgetSnapshot()
+{
+  if (m_pfnGetMemProps2 != nullptr)
+  {
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budgetProps = {};
+    budgetProps.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+
+    VkPhysicalDeviceMemoryProperties2KHR memProps2 = {};
+    memProps2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2_KHR;
+    memProps2.pNext = &budgetProps;
+    m_pfnGetMemProps2(m_physDevice, &memProps2);
+
+    for (uint32_t heapId = 0; heapId < m_memProps.memoryHeapCount; heapId++)
+    {
+      m_snapshotUsage [heapId] = budgetProps.heapUsage[heapId];
+      m_snapshotBudget[heapId] = std::min(budgetProps.heapBudget[heapId], m_memProps.memoryHeaps[heapId].size);
+    }
+  }
+  else
+  {
+    for (uint32_t heapId = 0; heapId < m_memProps.memoryHeapCount; heapId++)
+    {
+      m_snapshotUsage [heapId] = m_heapBlockBytes[heapId];
+      m_snapshotBudget[heapId] = m_memProps.memoryHeaps[heapId].size*8/10; // leave some space for other processes and the driver
+    }
+  }
+
+  for (uint32_t heapId = 0; heapId < m_memProps.memoryHeapCount; heapId++)
+    m_snapshotBlockBytes[heapId] = m_heapBlockBytes[heapId];
+  m_blockOpsSinceSnapshot = 0;
+}
+
+vk_utils::HeapBudget vk_utils::DeviceMemoryAllocator::EstimateBudget(uint32_t a_heapId) const
+{
+  // driver may update its numbers with a delay, so our own changes since the last snapshot are added on top
+  //
+  HeapBudget res;
+  res.heapSize   = m_memProps.memoryHeaps[a_heapId].size;
+  res.budget     = m_snapshotBudget[a_heapId];
+  res.blockBytes = m_heapBlockBytes[a_heapId];
+
+  if (m_heapBlockBytes[a_heapId] >= m_snapshotBlockBytes[a_heapId])
+    res.usage = m_snapshotUsage[a_heapId] + (m_heapBlockBytes[a_heapId] - m_snapshotBlockBytes[a_heapId]);
+  else
+    res.usage = m_snapshotUsage[a_heapId] - std::min(m_snapshotUsage[a_heapId], m_snapshotBlockBytes[a_heapId] - m_heapBlockBytes[a_heapId]);
+
+  return res;
+}
+
+void vk_utils::DeviceMemoryAllocator::GetBudget(std::vector<HeapBudget>* a_pBudget)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  UpdateBudgetSnapshot();
+
+  a_pBudget->resize(m_memProps.memoryHeapCount);
+  for (uint32_t heapId = 0; heapId < m_memProps.memoryHeapCount; heapId++)
+    (*a_pBudget)[heapId] = EstimateBudget(heapId);
+}
+
+void vk_utils::DeviceMemoryAllocator::SetBudgetCallback(BudgetCallback a_callback, float a_highWaterMark)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_budgetCallback = a_callback;
+    m_highWaterMark  = a_highWaterMark;
+    for (uint32_t heapId = 0; heapId < VK_MAX_MEMORY_HEAPS; heapId++)
+      m_aboveMark[heapId] = false;
+  }
+  CheckHighWaterMark(); // usage may be already above the new mark
+}
+
+void vk_utils::DeviceMemoryAllocator::CheckHighWaterMark()
+{
+  static const uint32_t SNAPSHOT_PERIOD = 16; // block operations between driver queries
+
+  BudgetCallback callback;
+  std::vector<std::pair<uint32_t, HeapBudget> > crossed;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_budgetCallback)
+      return;
+
+    if (m_blockOpsSinceSnapshot >= SNAPSHOT_PERIOD)
+      UpdateBudgetSnapshot();
+
+    for (uint32_t heapId = 0; heapId < m_memProps.memoryHeapCount; heapId++)
+    {
+      const HeapBudget   budget = EstimateBudget(heapId);
+      const VkDeviceSize mark   = VkDeviceSize(double(budget.budget)*double(m_highWaterMark));
+      const bool         above  = (budget.usage > mark);
+
+      if (above && !m_aboveMark[heapId]) // only upward crossing is reported; falling below re-arms the callback
+        crossed.push_back(std::make_pair(heapId, budget));
+      m_aboveMark[heapId] = above;
+    }
+    callback = m_budgetCallback;
+  }
+
+  for (const auto& heap : crossed)
+    callback(heap.first, heap.second);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+vk_utils::FrameLinearAllocator::FrameLinearAllocator(DeviceMemoryAllocator* a_pAlloc, VkDeviceSize a_regionSize, uint32_t a_framesInFlight, VkBufferUsageFlags a_usage) :
+                                                     m_pAlloc(a_pAlloc), m_buffer(VK_NULL_HANDLE), m_framesInFlight(a_framesInFlight), m_currFrame(0)
+{
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(a_pAlloc->GetPhysicalDevice(), &props);
+
+  // any sub-allocation with default alignment could be used as uniform or storage buffer with dynamic offset
+  //
+  m_defaultAlignment = std::max(props.limits.minUniformBufferOffsetAlignment, props.limits.minStorageBufferOffsetAlignment);
+  m_defaultAlignment = std::max(m_defaultAlignment, VkDeviceSize(16));
+  m_regionSize       = AlignUp(a_regionSize, m_defaultAlignment);
+
+  VkBufferCreateInfo bufferCreateInfo = {};
+  bufferCreateInfo.sType       = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferCreateInfo.pNext       = nullptr;
+  bufferCreateInfo.size        = m_regionSize*a_framesInFlight;
+  bufferCreateInfo.usage       = a_usage;
+  bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  VK_CHECK_RESULT(vkCreateBuffer(a_pAlloc->GetDevice(), &bufferCreateInfo, NULL, &m_buffer));
+
+  m_memory = a_pAlloc->AllocateAndBindBuffer(m_buffer, vk_utils::GetMemoryTypeRequest(MEMORY_USAGE_STREAMING), // device local if resizable BAR is present
+                                           "FrameLinearAllocator regions");
+
+  m_regionBegin = 0;
+  m_top         = 0;
+}
+
+vk_utils::FrameLinearAllocator::~FrameLinearAllocator()
+{
+  vkDestroyBuffer(m_pAlloc->GetDevice(), m_buffer, NULL);
+  m_pAlloc->Free(m_memory);
+}
+
+void vk_utils::FrameLinearAllocator::BeginFrame(uint32_t a_frameId, VkFence a_frameFence)
+{
+  if (a_frameId >= m_framesInFlight)
+    RUN_TIME_ERROR("[FrameLinearAllocator::BeginFrame]: frame id is out of range");
+
+  // the GPU may still read the data of this region if the frame fence is not signalled yet
+  //
+  if (a_frameFence != VK_NULL_HANDLE && vkGetFenceStatus(m_pAlloc->GetDevice(), a_frameFence) != VK_SUCCESS)
+    RUN_TIME_ERROR("[FrameLinearAllocator::BeginFrame]: frame fence is not signalled, region is still in use");
+
+  m_currFrame   = a_frameId;
+  m_regionBegin = m_regionSize*a_frameId;
+  m_top         = m_regionBegin;
+}
+
+vk_utils::FrameAllocation vk_utils::FrameLinearAllocator::Alloc(VkDeviceSize a_size, VkDeviceSize a_alignment)
+{
+  const VkDeviceSize alignment = (a_alignment == 0) ? m_defaultAlignment : a_alignment;
+  const VkDeviceSize offset    = AlignUp(m_top, alignment);
+
+  if (offset + a_size > m_regionBegin + m_regionSize)
+    RUN_TIME_ERROR("[FrameLinearAllocator::Alloc]: out of frame memory, increase region size");
+
+  m_top = offset + a_size;
+
+  FrameAllocation res;
+  res.buffer = m_buffer;
+  res.offset = offset;
+  res.mapped = (char*)m_memory.mapped + offset;
+  return res;
+}
+
+vk_utils::FrameAllocation vk_utils::FrameLinearAllocator::Push(const void* a_data, VkDeviceSize a_size, VkDeviceSize a_alignment)
+{
+  FrameAllocation res = Alloc(a_size, a_alignment);
+  memcpy(res.mapped, a_data, size_t(a_size));
+  return res;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+vk_utils::TransientImageAllocator::TransientImageAllocator(DeviceMemoryAllocator* a_pAlloc) : m_pAlloc(a_pAlloc), m_memoryBytes(0), m_unaliasedBytes(0)
+{
+
+}
+
+vk_utils::TransientImageAllocator::~TransientImageAllocator()
+{
+  Reset();
+}
+
+uint32_t vk_utils::TransientImageAllocator::AddImage(const VkImageCreateInfo& a_createInfo, uint32_t a_firstPass, uint32_t a_lastPass)
+{
+  if (a_createInfo.tiling != VK_IMAGE_TILING_OPTIMAL)
+    RUN_TIME_ERROR("[TransientImageAllocator::AddImage]: only optimal tiling is supported");
+  if (a_firstPass > a_lastPass)
+    RUN_TIME_ERROR("[TransientImageAllocator::AddImage]: firstPass > lastPass");
+
+  TransientImage img;
+  img.createInfo = a_createInfo;
+  img.firstPass  = a_firstPass;
+  img.lastPass   = a_lastPass;
+  img.image      = VK_NULL_HANDLE;
+  img.memTypeId  = 0;
+  img.offset     = 0;
+  m_images.push_back(img);
+  return uint32_t(m_images.size() - 1);
+}
+
+void vk_utils::TransientImageAllocator::Build()
+{
+  Reset();
+
+  VkDevice device = m_pAlloc->GetDevice();
+  const VkPhysicalDeviceMemoryProperties& memProps = vk_utils::GetMemoryProperties(m_pAlloc->GetPhysicalDevice());
+
+  // (1) create images and choose memory type for each one
+  //
+  for (auto& img : m_images)
+  {
+    VK_CHECK_RESULT(vkCreateImage(device, &img.createInfo, NULL, &img.image));
+    vkGetImageMemoryRequirements(device, img.image, &img.memReq);
+
+    MemoryTypeRequest request(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    if (img.createInfo.usage & VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT)
+      request.preferred = VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT;
+
+    img.memTypeId     = vk_utils::FindMemoryType(img.memReq.memoryTypeBits, request, m_pAlloc->GetPhysicalDevice());
+    m_unaliasedBytes += img.memReq.size;
+  }
+
+  // (2) greedy placement in each memory type: biggest first, lowest offset that does not collide with images alive at the same time
+  //
+  std::vector<uint32_t> order(m_images.size());
+  for (uint32_t i = 0; i < order.size(); i++)
+    order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) { return m_images[a].memReq.size > m_images[b].memReq.size; });
+
+  for (uint32_t memTypeId = 0; memTypeId < memProps.memoryTypeCount; memTypeId++)
+  {
+    std::vector<uint32_t> placed;
+    VkDeviceSize          groupSize      = 0;
+    VkDeviceSize          groupAlignment = 1;
+
+    for (uint32_t imageId : order)
+    {
+      TransientImage& img = m_images[imageId];
+      if (img.memTypeId != memTypeId)
+        continue;
+
+      std::vector< std::pair<VkDeviceSize, VkDeviceSize> > busy; // [begin, end) of images alive at the same time
+      for (uint32_t otherId : placed)
+      {
+        const TransientImage& other = m_images[otherId];
+        if (other.firstPass <= img.lastPass && img.firstPass <= other.lastPass)
+          busy.push_back(std::make_pair(other.offset, other.offset + other.memReq.size));
+      }
+      std::sort(busy.begin(), busy.end());
+
+      VkDeviceSize offset = 0;
+      for (const auto& range : busy)
+      {
+        if (AlignUp(offset, img.memReq.alignment) + img.memReq.size <= range.first)
+          break;
+        offset = std::max(offset, range.second);
+      }
+
+      img.offset     = AlignUp(offset, img.memReq.alignment);
+      groupSize      = std::max(groupSize, img.offset + img.memReq.size);
+      groupAlignment = std::max(groupAlignment, img.memReq.alignment);
+      placed.push_back(imageId);
+    }
+
+    if (placed.empty())
+      continue;
+
+    // (3) one allocation for the whole group, then bind every image to its offset inside of it
+    //
+    VkMemoryRequirements groupReq = {};
+    groupReq.size           = groupSize;
+    groupReq.alignment      = groupAlignment;
+    groupReq.memoryTypeBits = (1u << memTypeId);
+
+    MemAllocation mem = m_pAlloc->Allocate(groupReq, MemoryTypeRequest(memProps.memoryTypes[memTypeId].propertyFlags), SUBALLOC_IMAGE_OPTIMAL);
+    for (uint32_t imageId : placed)
+      VK_CHECK_RESULT(vkBindImageMemory(device, m_images[imageId].image, mem.memory, mem.offset + m_images[imageId].offset));
+
+    m_pAlloc->SetDebugInfo(mem, 0, "TransientImageAllocator aliased images");
+    m_memory.push_back(mem);
+    m_memoryBytes += groupSize;
+  }
+}
+
+void vk_utils::TransientImageAllocator::Reset()
+{
+  for (auto& img : m_images)
+  {
+    if (img.image != VK_NULL_HANDLE)
+      vkDestroyImage(m_pAlloc->GetDevice(), img.image, NULL);
+    img.image = VK_NULL_HANDLE;
+  }
+
+  for (const auto& mem : m_memory)
+    m_pAlloc->Free(mem);
+  m_memory.clear();
+
+  m_memoryBytes    = 0;
+  m_unaliasedBytes = 0;
+}
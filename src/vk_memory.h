@@ -0,0 +1,282 @@
+#ifndef VULKAN_MINIMAL_GRAPHICS_VK_MEMORY_H
+#define VULKAN_MINIMAL_GRAPHICS_VK_MEMORY_H
+
+#include <vulkan/vulkan.h>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <set>
+#include <map>
+#include <ostream>
+
+#include "vk_utils.h"
+
+namespace vk_utils
+{
+  //// Device memory sub-allocation
+  //
+  enum SUBALLOC_KIND { SUBALLOC_FREE          = 0,
+                       SUBALLOC_BUFFER        = 1,   // buffers and linear images are 'linear' resources
+                       SUBALLOC_IMAGE_LINEAR  = 2,   //
+                       SUBALLOC_IMAGE_OPTIMAL = 3 }; // optimal images must not share a bufferImageGranularity page with linear ones
+
+  struct MemBlock;
+
+  struct MemAllocation
+  {
+    VkDeviceMemory memory    = VK_NULL_HANDLE;
+    VkDeviceSize   offset    = 0;
+    VkDeviceSize   size      = 0;
+    uint32_t       memTypeId = 0;
+    VkMemoryPropertyFlags memProps = 0; // actual flags of the chosen memory type; may have more than requested
+    void*          mapped    = nullptr; // not null for host visible memory; points to 'offset' inside of persistently mapped block
+    MemBlock*      pBlock    = nullptr; // owner block, used internally by Free
+  };
+
+  struct HeapUsage
+  {
+    VkDeviceSize heapSize        = 0;
+    VkDeviceSize blockBytes      = 0; // memory allocated from the driver with vkAllocateMemory
+    VkDeviceSize allocationBytes = 0; // memory actually given to buffers and images
+    uint32_t     blockCount      = 0;
+    uint32_t     allocationCount = 0;
+  };
+
+  /**
+  \brief Buffer created by DeviceMemoryAllocator::CreateBuffer; the pointer is stable, but defragmentation may replace
+  'buffer' and 'memory' (then 'generation' is incremented). Set 'movable' to false for buffers that GPU writes every frame
+  or CPU keeps a pointer to; host visible buffers are not movable by default. 'id' is unique for the allocator lifetime and,
+  unlike the pointer, is never reused, so it identifies the buffer across asynchronous operations.
+  */
+  struct AllocatedBuffer
+  {
+    VkBuffer           buffer     = VK_NULL_HANDLE;
+    MemAllocation      memory;
+    VkDeviceSize       size       = 0;
+    VkBufferUsageFlags usage      = 0;
+    uint64_t           id         = 0;
+    uint32_t           generation = 0;
+    bool               movable    = true;
+  };
+
+  struct HeapBudget
+  {
+    VkDeviceSize heapSize   = 0;
+    VkDeviceSize budget     = 0; // how much this process may use before allocations fail or the driver starts paging
+    VkDeviceSize usage      = 0; // whole process usage if VK_EXT_memory_budget is enabled, blocks of this allocator otherwise
+    VkDeviceSize blockBytes = 0; // memory allocated by this allocator
+  };
+
+  typedef std::function<void(uint32_t a_heapId, const HeapBudget& a_budget)> BudgetCallback;
+
+  /**
+  \brief Keeps large per-memory-type blocks and places buffers and images inside them.
+
+  Freed ranges are merged with their free neighbours and reused through per-block free lists (best fit by size).
+  Allocations bigger than half of a block get their own dedicated vkAllocateMemory.
+  If the best memory type is out of memory, the next candidate from GetMemoryTypeCandidates is tried.
+  Host visible blocks are persistently mapped, so MemAllocation::mapped can be written directly.
+
+  Per-heap budget comes from VK_EXT_memory_budget when it is enabled (EnableMemoryBudgetExt); driver data is refreshed
+  every few block allocations and own accounting is added in between. Without the extension, budget is 80% of heap size
+  and usage is what this allocator took. Budget callback is called when heap usage crosses the high-water mark, outside
+  of the allocator lock, so it may evict resources and Free their memory.
+  All methods are thread safe.
+  */
+  class DeviceMemoryAllocator
+  {
+  public:
+
+    static const VkDeviceSize DEFAULT_BLOCK_SIZE = VkDeviceSize(64*1024*1024);
+
+    DeviceMemoryAllocator(VkDevice a_device, VkPhysicalDevice a_physDevice, VkDeviceSize a_blockSize = DEFAULT_BLOCK_SIZE);
+    ~DeviceMemoryAllocator();
+
+    DeviceMemoryAllocator(const DeviceMemoryAllocator& a_rhs)            = delete;
+    DeviceMemoryAllocator& operator=(const DeviceMemoryAllocator& a_rhs) = delete;
+
+    MemAllocation Allocate(const VkMemoryRequirements& a_memReq, const MemoryTypeRequest& a_request, SUBALLOC_KIND a_kind);
+    void          Free(const MemAllocation& a_alloc);
+
+    MemAllocation AllocateAndBindBuffer(VkBuffer a_buffer, const MemoryTypeRequest& a_request, const char* a_debugName = nullptr);
+    MemAllocation AllocateAndBindImage (VkImage a_image, VkImageTiling a_tiling, const MemoryTypeRequest& a_request, const char* a_debugName = nullptr);
+
+    AllocatedBuffer* CreateBuffer(VkDeviceSize a_size, VkBufferUsageFlags a_usage, const MemoryTypeRequest& a_request,
+                                  const char* a_debugName = nullptr); // EXCLUSIVE sharing, may be moved
+    void             DestroyBuffer(AllocatedBuffer* a_pBuffer);
+
+    // defragmentation support, see MemoryDefragmenter; buffers are referenced by id, so a destroyed buffer is never
+    // confused with a new one at the same address. If a buffer is destroyed between BeginMove and EndMove, its old
+    // buffer and memory are kept until EndMove or CancelMove, because the copy may still read them.
+    //
+    uint32_t         BeginDefragmentation(float a_maxOccupancy, std::vector<uint64_t>* a_pToMove);    // marks sparse blocks, returns their count
+    bool             BeginMove(uint64_t a_bufferId, AllocatedBuffer* a_pDst, VkBuffer* a_pSrc);    // new buffer and memory outside of marked blocks
+    AllocatedBuffer* EndMove(uint64_t a_bufferId, AllocatedBuffer* a_pDst);  // swaps them, a_pDst gets what must be released later; null if destroyed
+    void             CancelMove(uint64_t a_bufferId);                        // the copy was not applied, a_pDst of BeginMove is released by the caller
+    void             EndDefragmentation();
+
+    void GetHeapUsage(std::vector<HeapUsage>* a_pUsage) const;
+    void PrintHeapUsage() const;
+
+    // residency report: every block with fragmentation statistics and every allocation with its owner, as JSON
+    //
+    void SetDebugInfo(const MemAllocation& a_alloc, uint64_t a_ownerHandle, const char* a_debugName); // Allocate*/CreateBuffer do it for you
+    void WriteResidencyReport(std::ostream& a_out) const;
+    bool SaveResidencyReport(const char* a_fileName) const;
+
+    void EnableMemoryBudgetExt(VkInstance a_instance); // call only if VK_EXT_memory_budget is enabled for the device
+    void GetBudget(std::vector<HeapBudget>* a_pBudget); // always queries fresh driver data
+    void SetBudgetCallback(BudgetCallback a_callback, float a_highWaterMark = 0.9f); // a_highWaterMark is a fraction of budget
+
+    VkDevice         GetDevice()         const { return m_device; }
+    VkPhysicalDevice GetPhysicalDevice() const { return m_physDevice; }
+
+  private:
+
+    MemBlock* CreateBlock(uint32_t a_memTypeId, VkDeviceSize a_size, bool a_dedicated);
+    void      DestroyBlock(MemBlock* a_pBlock);
+    MemBlock* AllocateInType(uint32_t a_memTypeId, VkDeviceSize a_size, VkDeviceSize a_alignment, SUBALLOC_KIND a_kind, VkDeviceSize* a_pOffset,
+                             bool a_allowNewBlock = true);
+    bool      TryAllocateInBlock(MemBlock* a_pBlock, VkDeviceSize a_size, VkDeviceSize a_alignment, SUBALLOC_KIND a_kind, VkDeviceSize* a_pOffset);
+    void      FreeInBlock(MemBlock* a_pBlock, VkDeviceSize a_offset);
+
+    void       UpdateBudgetSnapshot();
+    HeapBudget EstimateBudget(uint32_t a_heapId) const;
+    void       CheckHighWaterMark(); // must be called without lock
+
+    VkDevice         m_device;
+    VkPhysicalDevice m_physDevice;
+    VkDeviceSize     m_blockSize;
+    VkDeviceSize     m_granularity;
+    uint32_t         m_maxAllocationCount;
+    uint32_t         m_allocationCount;
+
+    VkPhysicalDeviceMemoryProperties m_memProps;
+    std::vector<MemBlock*>           m_blocks[VK_MAX_MEMORY_TYPES];
+    std::map<uint64_t, AllocatedBuffer*> m_buffers;      // created with CreateBuffer, by id
+    std::set<uint64_t>                   m_moving;       // between BeginMove and EndMove/CancelMove
+    std::map<uint64_t, AllocatedBuffer>  m_orphanMoves;  // destroyed while moving; released when the copy is done
+    uint64_t                             m_nextBufferId;
+
+    PFN_vkGetPhysicalDeviceMemoryProperties2KHR m_pfnGetMemProps2;
+    VkDeviceSize   m_heapBlockBytes    [VK_MAX_MEMORY_HEAPS]; // own accounting
+    VkDeviceSize   m_snapshotUsage     [VK_MAX_MEMORY_HEAPS]; // driver data of the last snapshot
+    VkDeviceSize   m_snapshotBudget    [VK_MAX_MEMORY_HEAPS]; //
+    VkDeviceSize   m_snapshotBlockBytes[VK_MAX_MEMORY_HEAPS]; // own accounting at the moment of the last snapshot
+    uint32_t       m_blockOpsSinceSnapshot;
+    BudgetCallback m_budgetCallback;
+    float          m_highWaterMark;
+    bool           m_aboveMark[VK_MAX_MEMORY_HEAPS];
+
+    mutable std::mutex m_mutex;
+  };
+
+  //// Render target aliasing
+  //
+  /**
+  \brief Places attachments of one frame into shared memory, so images with non-overlapping lifetimes alias each other.
+
+  Lifetime of an image is an interval of pass indices [firstPass, lastPass] where it is written or read.
+  Build creates all images, groups them by memory type and greedily assigns offsets (biggest images first, lowest
+  offset that does not overlap any placed image with an overlapping lifetime). Each group takes one allocation.
+  Images with VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT prefer LAZILY_ALLOCATED memory (tile memory on mobile GPUs).
+  Content of an aliased image is undefined at its first pass: transition it from VK_IMAGE_LAYOUT_UNDEFINED there.
+  Images are shared by all passes of one frame; use a separate allocator per frame in flight if frames overlap.
+  Only optimal tiling is supported. Not thread safe.
+  */
+  class TransientImageAllocator
+  {
+  public:
+
+    TransientImageAllocator(DeviceMemoryAllocator* a_pAlloc);
+    ~TransientImageAllocator();
+
+    TransientImageAllocator(const TransientImageAllocator& a_rhs)            = delete;
+    TransientImageAllocator& operator=(const TransientImageAllocator& a_rhs) = delete;
+
+    uint32_t AddImage(const VkImageCreateInfo& a_createInfo, uint32_t a_firstPass, uint32_t a_lastPass); // returns image id; call before Build
+    void     Build();
+    void     Reset(); // destroys images and memory, keeps image descriptions; call Build again e.g. after resize
+
+    VkImage       GetImage(uint32_t a_imageId) const { return m_images[a_imageId].image; }
+    VkImageCreateInfo& CreateInfo(uint32_t a_imageId) { return m_images[a_imageId].createInfo; } // to change extent before next Build
+
+    VkDeviceSize GetMemoryBytes()    const { return m_memoryBytes; }    // with aliasing
+    VkDeviceSize GetUnaliasedBytes() const { return m_unaliasedBytes; } // if every image had its own memory
+
+  private:
+
+    struct TransientImage
+    {
+      VkImageCreateInfo    createInfo;
+      uint32_t             firstPass;
+      uint32_t             lastPass;
+      VkImage              image;
+      VkMemoryRequirements memReq;
+      uint32_t             memTypeId;
+      VkDeviceSize         offset;
+    };
+
+    DeviceMemoryAllocator*      m_pAlloc;
+    std::vector<TransientImage> m_images;
+    std::vector<MemAllocation>  m_memory; // one per memory type group
+    VkDeviceSize                m_memoryBytes;
+    VkDeviceSize                m_unaliasedBytes;
+  };
+
+  //// Per-frame transient data
+  //
+  struct FrameAllocation
+  {
+    VkBuffer     buffer = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;       // offset inside of 'buffer'; use it for vkCmdBindVertexBuffers or dynamic uniform offsets
+    void*        mapped = nullptr; // CPU pointer to write data to
+  };
+
+  /**
+  \brief Bump allocator for vertex, uniform and instance data that lives only one frame.
+
+  One host visible, coherent and persistently mapped buffer is split to 'a_framesInFlight' regions.
+  Allocation is just a pointer bump inside of the current frame region, there are no submits and no copies.
+  A region is reset by BeginFrame only when in-flight fence of that frame has signalled.
+  Not thread safe; should be used from the thread that records frame command buffers.
+  */
+  class FrameLinearAllocator
+  {
+  public:
+
+    static const VkBufferUsageFlags DEFAULT_USAGE = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT  | VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
+                                                    VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+
+    FrameLinearAllocator(DeviceMemoryAllocator* a_pAlloc, VkDeviceSize a_regionSize, uint32_t a_framesInFlight, VkBufferUsageFlags a_usage = DEFAULT_USAGE);
+    ~FrameLinearAllocator();
+
+    FrameLinearAllocator(const FrameLinearAllocator& a_rhs)            = delete;
+    FrameLinearAllocator& operator=(const FrameLinearAllocator& a_rhs) = delete;
+
+    void            BeginFrame(uint32_t a_frameId, VkFence a_frameFence);
+    FrameAllocation Alloc(VkDeviceSize a_size, VkDeviceSize a_alignment = 0);
+    FrameAllocation Push(const void* a_data, VkDeviceSize a_size, VkDeviceSize a_alignment = 0);
+
+    VkBuffer     GetBuffer()     const { return m_buffer; }
+    VkDeviceSize GetRegionSize() const { return m_regionSize; }
+    VkDeviceSize GetUsedBytes()  const { return m_top - m_regionBegin; }
+
+  private:
+
+    DeviceMemoryAllocator* m_pAlloc;
+    VkBuffer               m_buffer;
+    MemAllocation          m_memory;
+
+    VkDeviceSize m_regionSize;
+    VkDeviceSize m_defaultAlignment;
+    uint32_t     m_framesInFlight;
+
+    uint32_t     m_currFrame;
+    VkDeviceSize m_regionBegin;
+    VkDeviceSize m_top;
+  };
+
+};
+
+#endif //VULKAN_MINIMAL_GRAPHICS_VK_MEMORY_H
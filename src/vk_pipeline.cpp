@@ -0,0 +1,1104 @@
+#include "vk_pipeline.h"
+#include "vk_trace.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <algorithm>
+
+#ifdef WIN32
+#include <windows.h>
+#undef min
+#undef max
+#endif
+
+static const size_t PIPELINE_CACHE_HEADER_SIZE = 16 + VK_UUID_SIZE; // VkPipelineCacheHeaderVersionOne
+
+static bool ReadWholeFile(const char* a_fileName, std::vector<uint8_t>* a_pData)
+{
+  FILE* fp = fopen(a_fileName, "rb");
+  if (fp == NULL)
+    return false;
+
+  fseek(fp, 0, SEEK_END);
+  const long fileSize = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+
+  a_pData->resize(fileSize > 0 ? size_t(fileSize) : 0);
+  const size_t readBytes = a_pData->empty() ? 0 : fread(a_pData->data(), 1, a_pData->size(), fp);
+  fclose(fp);
+
+  return fileSize > 0 && readBytes == a_pData->size();
+}
+
+static uint32_t ReadU32(const uint8_t* a_ptr) // header is little endian on all platforms we care about, but don't rely on alignment
+{
+  uint32_t res;
+  memcpy(&res, a_ptr, sizeof(uint32_t));
+  return res;
+}
+
+static bool CacheHeaderIsValid(const std::vector<uint8_t>& a_data, const VkPhysicalDeviceProperties& a_props)
+{
+  if (a_data.size() < PIPELINE_CACHE_HEADER_SIZE)
+    return false;
+
+  const uint32_t headerSize    = ReadU32(a_data.data() + 0);
+  const uint32_t headerVersion = ReadU32(a_data.data() + 4);
+  const uint32_t vendorID      = ReadU32(a_data.data() + 8);
+  const uint32_t deviceID      = ReadU32(a_data.data() + 12);
+
+  return headerSize    >= PIPELINE_CACHE_HEADER_SIZE && headerSize <= a_data.size() &&
+         headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+         vendorID      == a_props.vendorID &&
+         deviceID      == a_props.deviceID &&
+         memcmp(a_data.data() + 16, a_props.pipelineCacheUUID, VK_UUID_SIZE) == 0; // UUID changes with driver version
+}
+
+VkPipelineCache vk_utils::CreatePipelineCache(VkDevice a_device, VkPhysicalDevice a_physDevice, const char* a_fileName)
+{
+  TRACE_SCOPE("CreatePipelineCache");
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(a_physDevice, &props);
+
+  std::vector<uint8_t> data;
+  if (ReadWholeFile(a_fileName, &data) && !CacheHeaderIsValid(data, props))
+  {
+    std::cout << "[CreatePipelineCache]: " << a_fileName << " is stale or broken, starting with empty cache" << std::endl;
+    data.clear();
+  }
+
+  VkPipelineCacheCreateInfo cacheInfo = {};
+  cacheInfo.sType           = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+  cacheInfo.initialDataSize = data.size();
+  cacheInfo.pInitialData    = data.empty() ? nullptr : data.data();
+
+  VkPipelineCache cache = VK_NULL_HANDLE;
+  if (vkCreatePipelineCache(a_device, &cacheInfo, nullptr, &cache) != VK_SUCCESS && !data.empty())
+  {
+    // driver may still reject data with a valid header, try again with empty cache
+    //
+    cacheInfo.initialDataSize = 0;
+    cacheInfo.pInitialData    = nullptr;
+    VK_CHECK_RESULT(vkCreatePipelineCache(a_device, &cacheInfo, nullptr, &cache));
+  }
+
+  return cache;
+}
+
+bool vk_utils::SavePipelineCache(VkDevice a_device, VkPipelineCache a_cache, const char* a_fileName)
+{
+  TRACE_SCOPE("SavePipelineCache");
+  size_t dataSize = 0;
+  VK_CHECK_RESULT(vkGetPipelineCacheData(a_device, a_cache, &dataSize, nullptr));
+
+  std::vector<uint8_t> data(dataSize);
+  if (dataSize == 0 || vkGetPipelineCacheData(a_device, a_cache, &dataSize, data.data()) != VK_SUCCESS)
+    return false;
+
+  const std::string tempName = std::string(a_fileName) + ".tmp";
+
+  FILE* fp = fopen(tempName.c_str(), "wb");
+  if (fp == NULL)
+  {
+    std::cout << "[SavePipelineCache]: can't open " << tempName.c_str() << " for writing" << std::endl;
+    return false;
+  }
+
+  const bool written = (fwrite(data.data(), 1, dataSize, fp) == dataSize);
+  const bool closed  = (fclose(fp) == 0);
+
+  if (!written || !closed)
+  {
+    remove(tempName.c_str());
+    return false;
+  }
+
+#ifdef WIN32
+  const bool renamed = (MoveFileExA(tempName.c_str(), a_fileName, MOVEFILE_REPLACE_EXISTING) != 0); // rename() fails if a_fileName exists
+#else
+  const bool renamed = (rename(tempName.c_str(), a_fileName) == 0);
+#endif
+
+  if (!renamed)
+    remove(tempName.c_str());
+  return renamed;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static bool HasDynamicState(const vk_utils::GraphicsPipelineDesc& a_desc, VkDynamicState a_state)
+{
+  return std::find(a_desc.dynamicStates.begin(), a_desc.dynamicStates.end(), a_state) != a_desc.dynamicStates.end();
+}
+
+static VkSpecializationInfo MakeSpecializationInfo(const vk_utils::SpecializationConstants& a_constants, std::vector<VkSpecializationMapEntry>* a_pEntries)
+{
+  a_pEntries->resize(a_constants.ids.size());
+  for (size_t i = 0; i < a_constants.ids.size(); i++)
+  {
+    (*a_pEntries)[i].constantID = a_constants.ids[i];
+    (*a_pEntries)[i].offset     = uint32_t(i*sizeof(uint32_t));
+    (*a_pEntries)[i].size       = sizeof(uint32_t);
+  }
+
+  VkSpecializationInfo info = {};
+  info.mapEntryCount = uint32_t(a_pEntries->size());
+  info.pMapEntries   = a_pEntries->data();
+  info.dataSize      = a_constants.values.size()*sizeof(uint32_t);
+  info.pData         = a_constants.values.data();
+  return info;
+}
+
+/**
+\brief All fixed function state of GraphicsPipelineDesc as Vulkan structures; filled once and shared by monolithic
+       pipelines and pipeline library parts. Pointers inside refer to members, so the object is not copyable.
+*/
+struct PipelineStates
+{
+  explicit PipelineStates(const vk_utils::GraphicsPipelineDesc& a_desc);
+
+  PipelineStates(const PipelineStates& a_rhs)            = delete;
+  PipelineStates& operator=(const PipelineStates& a_rhs) = delete;
+
+  VkGraphicsPipelineCreateInfo FullCreateInfo() const;
+
+  std::vector<VkSpecializationMapEntry>  vertEntries, fragEntries;
+  VkSpecializationInfo                   vertSpecInfo, fragSpecInfo;
+  VkPipelineShaderStageCreateInfo        shaderStages[2];
+  VkPipelineVertexInputStateCreateInfo   vertexInputInfo;
+  VkPipelineInputAssemblyStateCreateInfo inputAssembly;
+  VkViewport                             viewport;
+  VkRect2D                               scissor;
+  VkPipelineViewportStateCreateInfo      viewportState;
+  VkPipelineRasterizationStateCreateInfo rasterizer;
+  VkPipelineMultisampleStateCreateInfo   multisampling;
+  VkPipelineColorBlendAttachmentState    colorBlendAttachment;
+  VkPipelineColorBlendStateCreateInfo    colorBlending;
+  VkPipelineDynamicStateCreateInfo       dynamicState;
+
+  const vk_utils::GraphicsPipelineDesc&  desc;
+};
+
+PipelineStates::PipelineStates(const vk_utils::GraphicsPipelineDesc& a_desc) : desc(a_desc)
+{
+  vertSpecInfo = MakeSpecializationInfo(a_desc.vertConstants, &vertEntries);
+  fragSpecInfo = MakeSpecializationInfo(a_desc.fragConstants, &fragEntries);
+
+  memset(shaderStages, 0, sizeof(shaderStages));
+  shaderStages[0].sType  = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  shaderStages[0].stage  = VK_SHADER_STAGE_VERTEX_BIT;
+  shaderStages[0].module = a_desc.vertShader.module;
+  shaderStages[0].pName  = "main";
+  shaderStages[0].pSpecializationInfo = a_desc.vertConstants.Empty() ? nullptr : &vertSpecInfo;
+  shaderStages[1].sType  = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  shaderStages[1].stage  = VK_SHADER_STAGE_FRAGMENT_BIT;
+  shaderStages[1].module = a_desc.fragShader.module;
+  shaderStages[1].pName  = "main";
+  shaderStages[1].pSpecializationInfo = a_desc.fragConstants.Empty() ? nullptr : &fragSpecInfo;
+
+  vertexInputInfo = {};
+  vertexInputInfo.sType                           = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+  vertexInputInfo.vertexBindingDescriptionCount   = uint32_t(a_desc.vertexBindings.size());
+  vertexInputInfo.vertexAttributeDescriptionCount = uint32_t(a_desc.vertexAttributes.size());
+  vertexInputInfo.pVertexBindingDescriptions      = a_desc.vertexBindings.data();
+  vertexInputInfo.pVertexAttributeDescriptions    = a_desc.vertexAttributes.data();
+
+  inputAssembly = {};
+  inputAssembly.sType                  = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+  inputAssembly.topology               = a_desc.topology;
+  inputAssembly.primitiveRestartEnable = VK_FALSE;
+
+  viewport = {};
+  viewport.x        = 0.0f;
+  viewport.y        = 0.0f;
+  viewport.width    = (float)a_desc.viewportExtent.width;
+  viewport.height   = (float)a_desc.viewportExtent.height;
+  viewport.minDepth = 0.0f;
+  viewport.maxDepth = 1.0f;
+
+  scissor = {};
+  scissor.offset = { 0, 0 };
+  scissor.extent = a_desc.viewportExtent;
+
+  const bool dynamicViewport = HasDynamicState(a_desc, VK_DYNAMIC_STATE_VIEWPORT);
+  const bool dynamicScissor  = HasDynamicState(a_desc, VK_DYNAMIC_STATE_SCISSOR);
+
+  viewportState = {};
+  viewportState.sType         = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+  viewportState.viewportCount = 1;
+  viewportState.pViewports    = dynamicViewport ? nullptr : &viewport;
+  viewportState.scissorCount  = 1;
+  viewportState.pScissors     = dynamicScissor  ? nullptr : &scissor;
+
+  rasterizer = {};
+  rasterizer.sType                   = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+  rasterizer.depthClampEnable        = VK_FALSE;
+  rasterizer.rasterizerDiscardEnable = VK_FALSE;
+  rasterizer.polygonMode             = a_desc.polygonMode;
+  rasterizer.lineWidth               = 1.0f;
+  rasterizer.cullMode                = a_desc.cullMode;
+  rasterizer.frontFace               = a_desc.frontFace;
+  rasterizer.depthBiasEnable         = VK_FALSE;
+
+  multisampling = {};
+  multisampling.sType                = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+  multisampling.sampleShadingEnable  = VK_FALSE;
+  multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+  colorBlendAttachment = {};
+  colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+  colorBlendAttachment.blendEnable    = VK_FALSE;
+
+  colorBlending = {};
+  colorBlending.sType             = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+  colorBlending.logicOpEnable     = VK_FALSE;
+  colorBlending.logicOp           = VK_LOGIC_OP_COPY;
+  colorBlending.attachmentCount   = 1;
+  colorBlending.pAttachments      = &colorBlendAttachment;
+  colorBlending.blendConstants[0] = 0.0f;
+  colorBlending.blendConstants[1] = 0.0f;
+  colorBlending.blendConstants[2] = 0.0f;
+  colorBlending.blendConstants[3] = 0.0f;
+
+  dynamicState = {};
+  dynamicState.sType             = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+  dynamicState.dynamicStateCount = uint32_t(a_desc.dynamicStates.size());
+  dynamicState.pDynamicStates    = a_desc.dynamicStates.data();
+}
+
+VkGraphicsPipelineCreateInfo PipelineStates::FullCreateInfo() const
+{
+  VkGraphicsPipelineCreateInfo pipelineInfo = {};
+  pipelineInfo.sType               = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+  pipelineInfo.stageCount          = 2;
+  pipelineInfo.pStages             = shaderStages;
+  pipelineInfo.pVertexInputState   = &vertexInputInfo;
+  pipelineInfo.pInputAssemblyState = &inputAssembly;
+  pipelineInfo.pViewportState      = &viewportState;
+  pipelineInfo.pRasterizationState = &rasterizer;
+  pipelineInfo.pMultisampleState   = &multisampling;
+  pipelineInfo.pColorBlendState    = &colorBlending;
+  pipelineInfo.pDynamicState       = desc.dynamicStates.empty() ? nullptr : &dynamicState;
+  pipelineInfo.layout              = desc.layout;
+  pipelineInfo.renderPass          = desc.renderPass;
+  pipelineInfo.subpass             = desc.subpass;
+  pipelineInfo.basePipelineHandle  = VK_NULL_HANDLE;
+  return pipelineInfo;
+}
+
+VkPipeline vk_utils::CreateGraphicsPipeline(VkDevice a_device, VkPipelineCache a_cache, const GraphicsPipelineDesc& a_desc)
+{
+  TRACE_SCOPE("CreateGraphicsPipeline");
+  PipelineStates states(a_desc);
+  VkGraphicsPipelineCreateInfo pipelineInfo = states.FullCreateInfo();
+
+  VkPipeline pipeline = VK_NULL_HANDLE;
+  if (vkCreateGraphicsPipelines(a_device, a_cache, 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS)
+    RUN_TIME_ERROR("[CreateGraphicsPipeline]: failed to create graphics pipeline!");
+
+  return pipeline;
+}
+
+void vk_utils::SetViewportAndScissor(VkCommandBuffer a_cmdBuff, VkExtent2D a_extent)
+{
+  VkViewport viewport = {};
+  viewport.x        = 0.0f;
+  viewport.y        = 0.0f;
+  viewport.width    = (float)a_extent.width;
+  viewport.height   = (float)a_extent.height;
+  viewport.minDepth = 0.0f;
+  viewport.maxDepth = 1.0f;
+
+  VkRect2D scissor = {};
+  scissor.offset = { 0, 0 };
+  scissor.extent = a_extent;
+
+  vkCmdSetViewport(a_cmdBuff, 0, 1, &viewport);
+  vkCmdSetScissor (a_cmdBuff, 0, 1, &scissor);
+}
+
+bool vk_utils::IsExtendedDynamicStateSupported(VkInstance a_instance, VkPhysicalDevice a_physDevice)
+{
+  TRACE_SCOPE("IsExtendedDynamicStateSupported");
+  if (!IsDeviceExtensionSupported(a_physDevice, VK_EXT_EXTENDED_DYNAMIC_STATE_EXTENSION_NAME))
+    return false;
+
+  auto getFeatures2 = (PFN_vkGetPhysicalDeviceFeatures2KHR)vkGetInstanceProcAddr(a_instance, "vkGetPhysicalDeviceFeatures2KHR");
+  if (getFeatures2 == nullptr)
+    return false;
+
+  VkPhysicalDeviceExtendedDynamicStateFeaturesEXT dynamicStateFeatures = {};
+  dynamicStateFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_FEATURES_EXT;
+
+  VkPhysicalDeviceFeatures2KHR features2 = {};
+  features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+  features2.pNext = &dynamicStateFeatures;
+
+  getFeatures2(a_physDevice, &features2);
+  return dynamicStateFeatures.extendedDynamicState == VK_TRUE;
+}
+
+vk_utils::ExtendedDynamicStateFuncs vk_utils::LoadExtendedDynamicState(VkDevice a_device)
+{
+  ExtendedDynamicStateFuncs funcs;
+  funcs.vkCmdSetCullModeEXT          = (PFN_vkCmdSetCullModeEXT)vkGetDeviceProcAddr(a_device, "vkCmdSetCullModeEXT");
+  funcs.vkCmdSetFrontFaceEXT         = (PFN_vkCmdSetFrontFaceEXT)vkGetDeviceProcAddr(a_device, "vkCmdSetFrontFaceEXT");
+  funcs.vkCmdSetPrimitiveTopologyEXT = (PFN_vkCmdSetPrimitiveTopologyEXT)vkGetDeviceProcAddr(a_device, "vkCmdSetPrimitiveTopologyEXT");
+
+  if (funcs.vkCmdSetCullModeEXT == nullptr || funcs.vkCmdSetFrontFaceEXT == nullptr || funcs.vkCmdSetPrimitiveTopologyEXT == nullptr)
+    return ExtendedDynamicStateFuncs(); // extension is not enabled
+
+  return funcs;
+}
+
+vk_utils::PipelineCompiler::PipelineCompiler(VkDevice a_device, VkPipelineCache a_cache, ThreadPool* a_pThreadPool) :
+                                             m_device(a_device), m_cache(a_cache), m_pThreadPool(a_pThreadPool)
+{
+
+}
+
+vk_utils::PipelineCompiler::~PipelineCompiler()
+{
+  WaitIdle();
+
+  for (auto& job : m_jobs)
+  {
+    try
+    {
+      vkDestroyPipeline(m_device, job.get(), nullptr);
+    }
+    catch (const std::exception&) // failed job, nothing to destroy
+    {
+    }
+  }
+}
+
+std::shared_future<VkPipeline> vk_utils::PipelineCompiler::Compile(const GraphicsPipelineDesc& a_desc)
+{
+  VkDevice        device = m_device;
+  VkPipelineCache cache  = m_cache;
+
+  std::shared_future<VkPipeline> res = m_pThreadPool->Submit([device, cache, a_desc]() { return CreateGraphicsPipeline(device, cache, a_desc); }).share();
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_jobs.push_back(res);
+  return res;
+}
+
+void vk_utils::PipelineCompiler::WaitIdle()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (auto& job : m_jobs)
+    job.wait();
+}
+
+bool vk_utils::PipelineCompiler::IsReady(const std::shared_future<VkPipeline>& a_future)
+{
+  return a_future.valid() && a_future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+uint64_t vk_utils::HashBytes(const void* a_data, size_t a_size, uint64_t a_seed)
+{
+  const uint8_t* bytes = (const uint8_t*)a_data;
+  uint64_t hash = a_seed;
+  for (size_t i = 0; i < a_size; i++)
+  {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+bool vk_utils::PipelineStateKey::operator==(const PipelineStateKey& a_rhs) const
+{
+  return memcmp(this, &a_rhs, sizeof(PipelineStateKey)) == 0;
+}
+
+static uint64_t DynamicStateBit(VkDynamicState a_state)
+{
+  if (uint32_t(a_state) < 32)                                                                           // core states
+    return uint64_t(1) << uint32_t(a_state);
+  else if (a_state >= VK_DYNAMIC_STATE_CULL_MODE_EXT && a_state < VK_DYNAMIC_STATE_CULL_MODE_EXT + 32) // VK_EXT_extended_dynamic_state
+    return uint64_t(1) << (32 + uint32_t(a_state - VK_DYNAMIC_STATE_CULL_MODE_EXT));
+
+  RUN_TIME_ERROR("[MakePipelineStateKey]: unknown dynamic state");
+  return 0;
+}
+
+vk_utils::PipelineStateKey vk_utils::MakePipelineStateKey(const GraphicsPipelineDesc& a_desc)
+{
+  if (a_desc.vertexBindings.size() > PipelineStateKey::MAX_VERTEX_BINDINGS || a_desc.vertexAttributes.size() > PipelineStateKey::MAX_VERTEX_ATTRIBUTES)
+    RUN_TIME_ERROR("[MakePipelineStateKey]: too many vertex bindings or attributes");
+
+  PipelineStateKey key;
+  memset(&key, 0, sizeof(PipelineStateKey)); // padding takes part in hash and comparison
+
+  key.vertShader        = (uint64_t)(a_desc.vertShader.module);
+  key.fragShader        = (uint64_t)(a_desc.fragShader.module);
+  key.vertShaderHash    = a_desc.vertShader.hash;
+  key.fragShaderHash    = a_desc.fragShader.hash;
+  key.vertConstantsHash = a_desc.vertConstants.Hash();
+  key.fragConstantsHash = a_desc.fragConstants.Hash();
+  key.renderPass     = (uint64_t)(a_desc.renderPass);
+  key.layout         = (uint64_t)(a_desc.layout);
+  key.subpass        = a_desc.subpass;
+  key.topology       = uint8_t(a_desc.topology);
+  key.polygonMode    = uint8_t(a_desc.polygonMode);
+
+  for (VkDynamicState state : a_desc.dynamicStates)
+    key.dynamicStateMask |= DynamicStateBit(state);
+
+  // state that is set at record time must not split pipelines
+  //
+  if (!HasDynamicState(a_desc, VK_DYNAMIC_STATE_VIEWPORT) || !HasDynamicState(a_desc, VK_DYNAMIC_STATE_SCISSOR))
+  {
+    key.viewportWidth  = a_desc.viewportExtent.width;
+    key.viewportHeight = a_desc.viewportExtent.height;
+  }
+  if (!HasDynamicState(a_desc, VK_DYNAMIC_STATE_CULL_MODE_EXT))
+    key.cullMode = uint8_t(a_desc.cullMode);
+  if (!HasDynamicState(a_desc, VK_DYNAMIC_STATE_FRONT_FACE_EXT))
+    key.frontFace = uint8_t(a_desc.frontFace);
+  key.bindingCount   = uint32_t(a_desc.vertexBindings.size());
+  key.attributeCount = uint32_t(a_desc.vertexAttributes.size());
+
+  for (uint32_t i = 0; i < key.bindingCount; i++)
+  {
+    key.bindings[i].binding   = a_desc.vertexBindings[i].binding;
+    key.bindings[i].stride    = a_desc.vertexBindings[i].stride;
+    key.bindings[i].inputRate = uint32_t(a_desc.vertexBindings[i].inputRate);
+  }
+
+  for (uint32_t i = 0; i < key.attributeCount; i++)
+  {
+    key.attributes[i].location = a_desc.vertexAttributes[i].location;
+    key.attributes[i].binding  = a_desc.vertexAttributes[i].binding;
+    key.attributes[i].format   = uint32_t(a_desc.vertexAttributes[i].format);
+    key.attributes[i].offset   = a_desc.vertexAttributes[i].offset;
+  }
+
+  return key;
+}
+
+vk_utils::PipelineRegistry::Table::Table(uint32_t a_capacity) : capacity(a_capacity), slots(new std::atomic<Entry*>[a_capacity])
+{
+  for (uint32_t i = 0; i < capacity; i++)
+    slots[i].store(nullptr, std::memory_order_relaxed);
+}
+
+vk_utils::PipelineRegistry::PipelineRegistry(PipelineCompiler* a_pCompiler, uint32_t a_initialCapacity) : m_pCompiler(a_pCompiler), m_count(0)
+{
+  uint32_t capacity = 16;
+  while (capacity < a_initialCapacity)
+    capacity *= 2;
+
+  m_tables.push_back(std::unique_ptr<Table>(new Table(capacity)));
+  m_pTable.store(m_tables.back().get(), std::memory_order_release);
+}
+
+vk_utils::PipelineRegistry::~PipelineRegistry()
+{
+
+}
+
+const vk_utils::PipelineRegistry::Entry* vk_utils::PipelineRegistry::FindInTable(const Table* a_pTable, const PipelineStateKey& a_key, uint64_t a_hash)
+{
+  const uint32_t mask = a_pTable->capacity - 1;
+  for (uint32_t i = uint32_t(a_hash) & mask; ; i = (i + 1) & mask) // table is never full, so there is always an empty slot
+  {
+    const Entry* pEntry = a_pTable->slots[i].load(std::memory_order_acquire);
+    if (pEntry == nullptr)
+      return nullptr;
+    if (pEntry->hash == a_hash && pEntry->key == a_key)
+      return pEntry;
+  }
+}
+
+void vk_utils::PipelineRegistry::InsertToTable(Table* a_pTable, Entry* a_pEntry)
+{
+  const uint32_t mask = a_pTable->capacity - 1;
+  uint32_t i = uint32_t(a_pEntry->hash) & mask;
+  while (a_pTable->slots[i].load(std::memory_order_relaxed) != nullptr)
+    i = (i + 1) & mask;
+  a_pTable->slots[i].store(a_pEntry, std::memory_order_release); // entry is complete before readers can see it
+}
+
+bool vk_utils::PipelineRegistry::Find(const PipelineStateKey& a_key, std::shared_future<VkPipeline>* a_pPipeline) const
+{
+  const Entry* pEntry = FindInTable(m_pTable.load(std::memory_order_acquire), a_key, a_key.Hash());
+  if (pEntry == nullptr)
+    return false;
+
+  (*a_pPipeline) = pEntry->pipeline;
+  return true;
+}
+
+std::shared_future<VkPipeline> vk_utils::PipelineRegistry::GetOrCompile(const GraphicsPipelineDesc& a_desc)
+{
+  const PipelineStateKey key = MakePipelineStateKey(a_desc);
+
+  std::shared_future<VkPipeline> res;
+  if (Find(key, &res))
+    return res;
+
+  std::lock_guard<std::mutex> lock(m_writeMutex);
+  if (Find(key, &res)) // somebody added it while we were waiting
+    return res;
+
+  Table* pTable = m_pTable.load(std::memory_order_relaxed);
+  if (2*(m_count.load(std::memory_order_relaxed) + 1) > pTable->capacity) // keep load factor under 0.5, so probes are short
+  {
+    std::unique_ptr<Table> pGrown(new Table(pTable->capacity*2));
+    for (auto& pEntry : m_entries)
+      InsertToTable(pGrown.get(), pEntry.get());
+
+    pTable = pGrown.get();
+    m_tables.push_back(std::move(pGrown));
+    m_pTable.store(pTable, std::memory_order_release);
+  }
+
+  std::unique_ptr<Entry> pEntry(new Entry);
+  pEntry->key      = key;
+  pEntry->hash     = key.Hash();
+  pEntry->pipeline = m_pCompiler->Compile(a_desc);
+
+  InsertToTable(pTable, pEntry.get());
+  m_entries.push_back(std::move(pEntry));
+  m_count.fetch_add(1, std::memory_order_relaxed);
+
+  return m_entries.back()->pipeline;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void vk_utils::SpecializationConstants::Set(uint32_t a_constantId, uint32_t a_value)
+{
+  auto p = std::lower_bound(ids.begin(), ids.end(), a_constantId);
+  const size_t index = size_t(p - ids.begin());
+  if (p != ids.end() && *p == a_constantId)
+  {
+    values[index] = a_value;
+    return;
+  }
+
+  ids.insert(p, a_constantId);
+  values.insert(values.begin() + index, a_value);
+}
+
+uint64_t vk_utils::SpecializationConstants::Hash() const
+{
+  if (ids.empty())
+    return 0;
+  const uint64_t idsHash = HashBytes(ids.data(), ids.size()*sizeof(uint32_t));
+  return HashBytes(values.data(), values.size()*sizeof(uint32_t), idsHash);
+}
+
+uint32_t vk_utils::SpecFloat(float a_value)
+{
+  uint32_t bits;
+  memcpy(&bits, &a_value, sizeof(uint32_t));
+  return bits;
+}
+
+void vk_utils::ShaderVariantSet::AddConstant(VkShaderStageFlagBits a_stage, uint32_t a_constantId, const std::vector<uint32_t>& a_values)
+{
+  if (a_stage != VK_SHADER_STAGE_VERTEX_BIT && a_stage != VK_SHADER_STAGE_FRAGMENT_BIT)
+    RUN_TIME_ERROR("[ShaderVariantSet::AddConstant]: only vertex and fragment stages are supported");
+  if (a_values.empty())
+    RUN_TIME_ERROR("[ShaderVariantSet::AddConstant]: constant must have at least one value");
+
+  Constant constant;
+  constant.stage  = a_stage;
+  constant.id     = a_constantId;
+  constant.values = a_values;
+  m_constants.push_back(constant);
+}
+
+uint64_t vk_utils::ShaderVariantSet::GetVariantCount() const
+{
+  uint64_t count = 1;
+  for (const auto& constant : m_constants)
+    count *= constant.values.size();
+  return count;
+}
+
+uint64_t vk_utils::ShaderVariantSet::GetVariantIndex(const std::vector<uint32_t>& a_values) const
+{
+  if (a_values.size() != m_constants.size())
+    RUN_TIME_ERROR("[ShaderVariantSet::GetVariantIndex]: need one value per declared constant");
+
+  uint64_t index = 0;
+  uint64_t radix = 1;
+  for (size_t i = 0; i < m_constants.size(); i++)
+  {
+    const auto& values = m_constants[i].values;
+    auto p = std::find(values.begin(), values.end(), a_values[i]);
+    if (p == values.end())
+      RUN_TIME_ERROR("[ShaderVariantSet::GetVariantIndex]: value was not declared for the constant");
+
+    index += uint64_t(p - values.begin())*radix;
+    radix *= values.size();
+  }
+  return index;
+}
+
+vk_utils::GraphicsPipelineDesc vk_utils::ShaderVariantSet::GetVariant(uint64_t a_index) const
+{
+  if (a_index >= GetVariantCount())
+    RUN_TIME_ERROR("[ShaderVariantSet::GetVariant]: variant index is out of range");
+
+  GraphicsPipelineDesc desc = m_base;
+  for (const auto& constant : m_constants)
+  {
+    const uint32_t value = constant.values[a_index % constant.values.size()];
+    a_index /= constant.values.size();
+
+    if (constant.stage == VK_SHADER_STAGE_VERTEX_BIT)
+      desc.vertConstants.Set(constant.id, value);
+    else
+      desc.fragConstants.Set(constant.id, value);
+  }
+  return desc;
+}
+
+std::vector< std::shared_future<VkPipeline> > vk_utils::ShaderVariantSet::Prebuild(PipelineRegistry* a_pRegistry, const std::vector<uint64_t>& a_hotVariants) const
+{
+  std::vector< std::shared_future<VkPipeline> > res;
+  res.reserve(a_hotVariants.size());
+  for (uint64_t index : a_hotVariants)
+    res.push_back(a_pRegistry->GetOrCompile(GetVariant(index)));
+  return res;
+}
+
+vk_utils::ShaderModuleCache::ShaderModuleCache(VkDevice a_device) : m_device(a_device)
+{
+
+}
+
+vk_utils::ShaderModuleCache::~ShaderModuleCache()
+{
+  for (auto& module : m_modules)
+    vkDestroyShaderModule(m_device, module.second.module, nullptr);
+}
+
+vk_utils::ShaderRef vk_utils::ShaderModuleCache::AddRef(uint64_t a_hash, const uint32_t* a_code, size_t a_sizeInBytes)
+{
+  auto p = m_modules.find(a_hash);
+  if (p == m_modules.end())
+  {
+    Module module;
+    module.module   = CreateShaderModule(m_device, a_code, a_sizeInBytes);
+    module.refCount = 0;
+    p = m_modules.insert(std::make_pair(a_hash, module)).first;
+  }
+
+  p->second.refCount++;
+
+  ShaderRef res;
+  res.module = p->second.module;
+  res.hash   = a_hash;
+  return res;
+}
+
+vk_utils::ShaderRef vk_utils::ShaderModuleCache::AcquireFile(const char* a_fileName)
+{
+  TRACE_SCOPE("ShaderModuleCache::AcquireFile");
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto pFile = m_fileHashes.find(a_fileName);
+    if (pFile != m_fileHashes.end() && m_modules.find(pFile->second) != m_modules.end())
+      return AddRef(pFile->second, nullptr, 0);
+  }
+
+  // map and hash without the lock, so several threads may load different files at once
+  //
+  MappedFile file(a_fileName);
+  CheckSpirv(file.Data(), file.Size(), a_fileName);
+
+  const uint64_t hash = HashBytes(file.Data(), file.Size());
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_fileHashes[a_fileName] = hash;
+  return AddRef(hash, (const uint32_t*)file.Data(), file.Size());
+}
+
+vk_utils::ShaderRef vk_utils::ShaderModuleCache::Acquire(const uint32_t* a_code, size_t a_sizeInBytes)
+{
+  const uint64_t hash = HashBytes(a_code, a_sizeInBytes);
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return AddRef(hash, a_code, a_sizeInBytes);
+}
+
+void vk_utils::ShaderModuleCache::Release(const ShaderRef& a_shader)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  auto p = m_modules.find(a_shader.hash);
+  if (p == m_modules.end() || p->second.module != a_shader.module)
+    RUN_TIME_ERROR("[ShaderModuleCache::Release]: shader was not acquired from this cache");
+
+  if (--p->second.refCount == 0)
+  {
+    vkDestroyShaderModule(m_device, p->second.module, nullptr);
+    m_modules.erase(p);
+  }
+}
+
+uint32_t vk_utils::ShaderModuleCache::GetModuleCount() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return uint32_t(m_modules.size());
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifdef VK_EXT_graphics_pipeline_library
+
+static const VkGraphicsPipelineLibraryFlagBitsEXT g_libraryParts[] = { VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT,
+                                                                       VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT,
+                                                                       VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT,
+                                                                       VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_OUTPUT_INTERFACE_BIT_EXT };
+
+// every dynamic state belongs to exactly one part, as listed by VK_EXT_graphics_pipeline_library; only the states
+// PipelineStateKey can hold (core and VK_EXT_extended_dynamic_state) are known here
+//
+static VkGraphicsPipelineLibraryFlagBitsEXT DynamicStatePart(VkDynamicState a_state)
+{
+  switch (a_state)
+  {
+  case VK_DYNAMIC_STATE_PRIMITIVE_TOPOLOGY_EXT:
+  case VK_DYNAMIC_STATE_VERTEX_INPUT_BINDING_STRIDE_EXT:
+    return VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT;
+
+  case VK_DYNAMIC_STATE_VIEWPORT:
+  case VK_DYNAMIC_STATE_SCISSOR:
+  case VK_DYNAMIC_STATE_LINE_WIDTH:
+  case VK_DYNAMIC_STATE_DEPTH_BIAS:
+  case VK_DYNAMIC_STATE_CULL_MODE_EXT:
+  case VK_DYNAMIC_STATE_FRONT_FACE_EXT:
+  case VK_DYNAMIC_STATE_VIEWPORT_WITH_COUNT_EXT:
+  case VK_DYNAMIC_STATE_SCISSOR_WITH_COUNT_EXT:
+    return VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT;
+
+  case VK_DYNAMIC_STATE_DEPTH_BOUNDS:
+  case VK_DYNAMIC_STATE_STENCIL_COMPARE_MASK:
+  case VK_DYNAMIC_STATE_STENCIL_WRITE_MASK:
+  case VK_DYNAMIC_STATE_STENCIL_REFERENCE:
+  case VK_DYNAMIC_STATE_DEPTH_TEST_ENABLE_EXT:
+  case VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE_EXT:
+  case VK_DYNAMIC_STATE_DEPTH_COMPARE_OP_EXT:
+  case VK_DYNAMIC_STATE_DEPTH_BOUNDS_TEST_ENABLE_EXT:
+  case VK_DYNAMIC_STATE_STENCIL_TEST_ENABLE_EXT:
+  case VK_DYNAMIC_STATE_STENCIL_OP_EXT:
+    return VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT;
+
+  case VK_DYNAMIC_STATE_BLEND_CONSTANTS:
+    return VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_OUTPUT_INTERFACE_BIT_EXT;
+
+  default:
+    break;
+  }
+
+  RUN_TIME_ERROR("[GraphicsPipelineLibrary]: dynamic state is not assigned to any pipeline library part");
+  return VK_GRAPHICS_PIPELINE_LIBRARY_FLAG_BITS_MAX_ENUM_EXT;
+}
+
+static bool IsPartDynamicState(VkGraphicsPipelineLibraryFlagBitsEXT a_part, VkDynamicState a_state)
+{
+  return DynamicStatePart(a_state) == a_part;
+}
+
+// key with only the fields a part depends on, so e.g. all pipelines with the same vertex shader share one pre-rasterization part
+//
+static vk_utils::PipelineStateKey PartKey(VkGraphicsPipelineLibraryFlagBitsEXT a_part, const vk_utils::GraphicsPipelineDesc& a_desc, const vk_utils::PipelineStateKey& a_key)
+{
+  vk_utils::PipelineStateKey partKey;
+  memset(&partKey, 0, sizeof(vk_utils::PipelineStateKey));
+
+  for (VkDynamicState state : a_desc.dynamicStates)
+  {
+    if (IsPartDynamicState(a_part, state))
+      partKey.dynamicStateMask |= DynamicStateBit(state);
+  }
+
+  switch (a_part)
+  {
+  case VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT:
+    partKey.topology       = a_key.topology;
+    partKey.bindingCount   = a_key.bindingCount;
+    partKey.attributeCount = a_key.attributeCount;
+    memcpy(partKey.bindings,   a_key.bindings,   sizeof(a_key.bindings));
+    memcpy(partKey.attributes, a_key.attributes, sizeof(a_key.attributes));
+    break;
+
+  case VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT:
+    partKey.vertShader        = a_key.vertShader;
+    partKey.vertShaderHash    = a_key.vertShaderHash;
+    partKey.vertConstantsHash = a_key.vertConstantsHash;
+    partKey.layout            = a_key.layout;
+    partKey.renderPass        = a_key.renderPass;
+    partKey.subpass           = a_key.subpass;
+    partKey.viewportWidth     = a_key.viewportWidth;
+    partKey.viewportHeight    = a_key.viewportHeight;
+    partKey.polygonMode       = a_key.polygonMode;
+    partKey.cullMode          = a_key.cullMode;
+    partKey.frontFace         = a_key.frontFace;
+    break;
+
+  case VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT:
+    partKey.fragShader        = a_key.fragShader;
+    partKey.fragShaderHash    = a_key.fragShaderHash;
+    partKey.fragConstantsHash = a_key.fragConstantsHash;
+    partKey.layout            = a_key.layout;
+    partKey.renderPass        = a_key.renderPass;
+    partKey.subpass           = a_key.subpass;
+    break;
+
+  default: // fragment output
+    partKey.renderPass = a_key.renderPass;
+    partKey.subpass    = a_key.subpass;
+    break;
+  };
+
+  return partKey;
+}
+
+static VkPipeline LinkLibraries(VkDevice a_device, VkPipelineCache a_cache, const VkPipeline* a_pParts, VkPipelineLayout a_layout, VkPipelineCreateFlags a_flags)
+{
+  VkPipelineLibraryCreateInfoKHR linkInfo = {};
+  linkInfo.sType        = VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR;
+  linkInfo.libraryCount = uint32_t(sizeof(g_libraryParts)/sizeof(g_libraryParts[0]));
+  linkInfo.pLibraries   = a_pParts;
+
+  VkGraphicsPipelineCreateInfo pipelineInfo = {};
+  pipelineInfo.sType  = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+  pipelineInfo.pNext  = &linkInfo;
+  pipelineInfo.flags  = a_flags;
+  pipelineInfo.layout = a_layout;
+
+  VkPipeline pipeline = VK_NULL_HANDLE;
+  if (vkCreateGraphicsPipelines(a_device, a_cache, 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS)
+    RUN_TIME_ERROR("[GraphicsPipelineLibrary::Link]: failed to link graphics pipeline!");
+
+  return pipeline;
+}
+
+bool vk_utils::GraphicsPipelineLibrary::IsSupported(VkInstance a_instance, VkPhysicalDevice a_physDevice)
+{
+  TRACE_SCOPE("GraphicsPipelineLibrary::IsSupported");
+  if (!IsDeviceExtensionSupported(a_physDevice, VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME) ||
+      !IsDeviceExtensionSupported(a_physDevice, VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME))
+    return false;
+
+  auto getFeatures2 = (PFN_vkGetPhysicalDeviceFeatures2KHR)vkGetInstanceProcAddr(a_instance, "vkGetPhysicalDeviceFeatures2KHR");
+  if (getFeatures2 == nullptr)
+    return false;
+
+  VkPhysicalDeviceGraphicsPipelineLibraryFeaturesEXT libraryFeatures = {};
+  libraryFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_FEATURES_EXT;
+
+  VkPhysicalDeviceFeatures2KHR features2 = {};
+  features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+  features2.pNext = &libraryFeatures;
+
+  getFeatures2(a_physDevice, &features2);
+  return libraryFeatures.graphicsPipelineLibrary == VK_TRUE;
+}
+
+VkPipeline vk_utils::GraphicsPipelineLibrary::GetPart(uint32_t a_partId, const GraphicsPipelineDesc& a_desc, const PipelineStateKey& a_key)
+{
+  TRACE_SCOPE("GraphicsPipelineLibrary::GetPart");
+  const VkGraphicsPipelineLibraryFlagBitsEXT part    = g_libraryParts[a_partId];
+  const PipelineStateKey                     partKey = PartKey(part, a_desc, a_key);
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto p = m_parts[a_partId].find(partKey);
+    if (p != m_parts[a_partId].end())
+      return p->second;
+  }
+
+  // compile without the lock, so different parts may be built in parallel
+  //
+  PipelineStates states(a_desc);
+
+  std::vector<VkDynamicState> partStates;
+  for (VkDynamicState state : a_desc.dynamicStates)
+  {
+    if (IsPartDynamicState(part, state))
+      partStates.push_back(state);
+  }
+
+  VkPipelineDynamicStateCreateInfo dynamicState = states.dynamicState;
+  dynamicState.dynamicStateCount = uint32_t(partStates.size());
+  dynamicState.pDynamicStates    = partStates.data();
+
+  VkGraphicsPipelineLibraryCreateInfoEXT libraryInfo = {};
+  libraryInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_LIBRARY_CREATE_INFO_EXT;
+  libraryInfo.flags = part;
+
+  VkGraphicsPipelineCreateInfo pipelineInfo = {};
+  pipelineInfo.sType         = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+  pipelineInfo.pNext         = &libraryInfo;
+  pipelineInfo.flags         = VK_PIPELINE_CREATE_LIBRARY_BIT_KHR;
+  pipelineInfo.pDynamicState = partStates.empty() ? nullptr : &dynamicState;
+  if (m_pOptimizePool != nullptr)
+    pipelineInfo.flags |= VK_PIPELINE_CREATE_RETAIN_LINK_TIME_OPTIMIZATION_INFO_BIT_EXT; // needed for optimized linking
+
+  switch (part)
+  {
+  case VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT:
+    pipelineInfo.pVertexInputState   = &states.vertexInputInfo;
+    pipelineInfo.pInputAssemblyState = &states.inputAssembly;
+    break;
+
+  case VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT:
+    pipelineInfo.stageCount          = 1;
+    pipelineInfo.pStages             = &states.shaderStages[0];
+    pipelineInfo.pViewportState      = &states.viewportState;
+    pipelineInfo.pRasterizationState = &states.rasterizer;
+    pipelineInfo.layout              = a_desc.layout;
+    pipelineInfo.renderPass          = a_desc.renderPass;
+    pipelineInfo.subpass             = a_desc.subpass;
+    break;
+
+  case VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT:
+    pipelineInfo.stageCount          = 1;
+    pipelineInfo.pStages             = &states.shaderStages[1];
+    pipelineInfo.pMultisampleState   = &states.multisampling;
+    pipelineInfo.layout              = a_desc.layout;
+    pipelineInfo.renderPass          = a_desc.renderPass;
+    pipelineInfo.subpass             = a_desc.subpass;
+    break;
+
+  default:
+    pipelineInfo.pColorBlendState    = &states.colorBlending;
+    pipelineInfo.pMultisampleState   = &states.multisampling;
+    pipelineInfo.renderPass          = a_desc.renderPass;
+    pipelineInfo.subpass             = a_desc.subpass;
+    break;
+  };
+
+  VkPipeline pipeline = VK_NULL_HANDLE;
+  if (vkCreateGraphicsPipelines(m_device, m_cache, 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS)
+    RUN_TIME_ERROR("[GraphicsPipelineLibrary::GetPart]: failed to create pipeline library part!");
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto inserted = m_parts[a_partId].insert(std::make_pair(partKey, pipeline));
+  if (!inserted.second) // another thread has built the same part meanwhile
+    vkDestroyPipeline(m_device, pipeline, nullptr);
+  return inserted.first->second;
+}
+
+VkPipeline vk_utils::GraphicsPipelineLibrary::Link(const GraphicsPipelineDesc& a_desc, std::shared_future<VkPipeline>* a_pOptimized)
+{
+  TRACE_SCOPE("GraphicsPipelineLibrary::Link");
+  const PipelineStateKey key = MakePipelineStateKey(a_desc);
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto p = m_linked.find(key);
+    if (p != m_linked.end())
+    {
+      if (a_pOptimized != nullptr)
+        (*a_pOptimized) = p->second.optimized;
+      return p->second.fast;
+    }
+  }
+
+  std::vector<VkPipeline> parts(PART_COUNT); // shared with the background job
+  for (uint32_t partId = 0; partId < PART_COUNT; partId++)
+    parts[partId] = GetPart(partId, a_desc, key);
+
+  Linked linked;
+  linked.fast = LinkLibraries(m_device, m_cache, parts.data(), a_desc.layout, 0); // no link time optimization: fast
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto inserted = m_linked.insert(std::make_pair(key, linked));
+  if (!inserted.second)
+  {
+    vkDestroyPipeline(m_device, linked.fast, nullptr);
+  }
+  else if (m_pOptimizePool != nullptr)
+  {
+    VkDevice         device = m_device;
+    VkPipelineCache  cache  = m_cache;
+    VkPipelineLayout layout = a_desc.layout;
+    inserted.first->second.optimized = m_pOptimizePool->Submit([device, cache, parts, layout]()
+                                                               { return LinkLibraries(device, cache, parts.data(), layout, VK_PIPELINE_CREATE_LINK_TIME_OPTIMIZATION_BIT_EXT); }).share();
+  }
+
+  if (a_pOptimized != nullptr)
+    (*a_pOptimized) = inserted.first->second.optimized;
+  return inserted.first->second.fast;
+}
+
+#else
+
+bool vk_utils::GraphicsPipelineLibrary::IsSupported(VkInstance a_instance, VkPhysicalDevice a_physDevice)
+{
+  return false;
+}
+
+VkPipeline vk_utils::GraphicsPipelineLibrary::GetPart(uint32_t a_partId, const GraphicsPipelineDesc& a_desc, const PipelineStateKey& a_key)
+{
+  RUN_TIME_ERROR("[GraphicsPipelineLibrary]: built without VK_EXT_graphics_pipeline_library");
+  return VK_NULL_HANDLE;
+}
+
+VkPipeline vk_utils::GraphicsPipelineLibrary::Link(const GraphicsPipelineDesc& a_desc, std::shared_future<VkPipeline>* a_pOptimized)
+{
+  RUN_TIME_ERROR("[GraphicsPipelineLibrary]: built without VK_EXT_graphics_pipeline_library");
+  return VK_NULL_HANDLE;
+}
+
+#endif
+
+vk_utils::GraphicsPipelineLibrary::GraphicsPipelineLibrary(VkDevice a_device, VkPipelineCache a_cache, ThreadPool* a_pOptimizePool) :
+                                                           m_device(a_device), m_cache(a_cache), m_pOptimizePool(a_pOptimizePool)
+{
+
+}
+
+vk_utils::GraphicsPipelineLibrary::~GraphicsPipelineLibrary()
+{
+  for (auto& linked : m_linked)
+  {
+    if (linked.second.optimized.valid())
+    {
+      try
+      {
+        vkDestroyPipeline(m_device, linked.second.optimized.get(), nullptr); // waits for the job
+      }
+      catch (const std::exception&) // failed job, nothing to destroy
+      {
+      }
+    }
+    vkDestroyPipeline(m_device, linked.second.fast, nullptr);
+  }
+
+  for (auto& parts : m_parts) // linked pipelines do not need their libraries anymore, but we destroy them last anyway
+  {
+    for (auto& part : parts)
+      vkDestroyPipeline(m_device, part.second, nullptr);
+  }
+}
+
+uint32_t vk_utils::GraphicsPipelineLibrary::GetPartCount() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  size_t count = 0;
+  for (const auto& parts : m_parts)
+    count += parts.size();
+  return uint32_t(count);
+}
@@ -0,0 +1,378 @@
+#ifndef VULKAN_MINIMAL_GRAPHICS_VK_PIPELINE_H
+#define VULKAN_MINIMAL_GRAPHICS_VK_PIPELINE_H
+
+#include <vulkan/vulkan.h>
+#include <vector>
+#include <future>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "vk_utils.h"
+#include "vk_threads.h"
+
+namespace vk_utils
+{
+  //// Pipeline cache on disk
+  //
+  /**
+  \brief Creates pipeline cache with data from a_fileName, if the file exists and was written for the same device and driver.
+
+  Header of the file (vendorID, deviceID and pipelineCacheUUID) is checked before passing data to the driver;
+  a missing, broken or stale file just gives an empty cache.
+  */
+  VkPipelineCache CreatePipelineCache(VkDevice a_device, VkPhysicalDevice a_physDevice, const char* a_fileName);
+
+  /**
+  \brief Writes cache data to a temporary file and renames it to a_fileName, so a crash never leaves a half-written cache.
+  */
+  bool SavePipelineCache(VkDevice a_device, VkPipelineCache a_cache, const char* a_fileName);
+
+  //// Shader modules
+  //
+  struct ShaderRef
+  {
+    VkShaderModule module = VK_NULL_HANDLE;
+    uint64_t       hash   = 0;              // of SPIR-V, identifies the shader in PipelineStateKey together with the module
+  };
+
+  /**
+  \brief Shader modules shared by content hash of their SPIR-V and freed by reference count.
+
+  Files are mapped (MappedFile), hashed and passed to vkCreateShaderModule without a copy; a file path that is
+  already loaded is neither read nor hashed again, and equal binaries under different names give one module.
+  Every Acquire* must be paired with Release. Thread safe.
+  */
+  class ShaderModuleCache
+  {
+  public:
+
+    explicit ShaderModuleCache(VkDevice a_device);
+    ~ShaderModuleCache(); // destroys modules that were not released
+
+    ShaderModuleCache(const ShaderModuleCache& a_rhs)            = delete;
+    ShaderModuleCache& operator=(const ShaderModuleCache& a_rhs) = delete;
+
+    ShaderRef AcquireFile(const char* a_fileName);
+    ShaderRef Acquire(const uint32_t* a_code, size_t a_sizeInBytes);
+    void      Release(const ShaderRef& a_shader);
+
+    uint32_t  GetModuleCount() const;
+
+  private:
+
+    struct Module
+    {
+      VkShaderModule module;
+      uint32_t       refCount;
+    };
+
+    ShaderRef AddRef(uint64_t a_hash, const uint32_t* a_code, size_t a_sizeInBytes); // creates the module if needed; m_mutex must be locked
+
+    VkDevice                                  m_device;
+    mutable std::mutex                        m_mutex;
+    std::unordered_map<uint64_t, Module>      m_modules;    // by content hash
+    std::unordered_map<std::string, uint64_t> m_fileHashes; // file path -> content hash of loaded files
+  };
+
+  //// Specialization constants
+  //
+  /**
+  \brief Values of specialization constants of one shader stage; ids are 'constant_id' from the shader.
+
+  All constants are 32 bit: int, uint, bool (0 or 1, as VkBool32) or float bits (SpecFloat). Ids are kept sorted,
+  so equal sets compare and hash equal regardless of the order of Set calls. Ids that are not declared in the
+  shader are ignored by Vulkan.
+  */
+  struct SpecializationConstants
+  {
+    void     Set(uint32_t a_constantId, uint32_t a_value);
+    bool     Empty() const { return ids.empty(); }
+    uint64_t Hash()  const;
+
+    std::vector<uint32_t> ids;
+    std::vector<uint32_t> values;
+  };
+
+  uint32_t SpecFloat(float a_value); // bits of a float constant
+
+  //// Graphics pipelines
+  //
+  struct GraphicsPipelineDesc
+  {
+    ShaderRef vertShader; // from ShaderModuleCache, must stay acquired until the pipeline is built
+    ShaderRef fragShader; //
+
+    SpecializationConstants vertConstants;
+    SpecializationConstants fragConstants;
+
+    std::vector<VkVertexInputBindingDescription>   vertexBindings;
+    std::vector<VkVertexInputAttributeDescription> vertexAttributes;
+
+    VkPrimitiveTopology topology       = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    VkPolygonMode       polygonMode    = VK_POLYGON_MODE_FILL;
+    VkCullModeFlags     cullMode       = VK_CULL_MODE_NONE;
+    VkFrontFace         frontFace      = VK_FRONT_FACE_CLOCKWISE;
+    VkExtent2D          viewportExtent = {0, 0}; // static viewport and scissor; ignored if they are in dynamicStates
+
+    std::vector<VkDynamicState> dynamicStates;   // set with vkCmdSet* at record time, see SetViewportAndScissor
+
+    VkPipelineLayout    layout         = VK_NULL_HANDLE;
+    VkRenderPass        renderPass     = VK_NULL_HANDLE;
+    uint32_t            subpass        = 0;
+  };
+
+  VkPipeline CreateGraphicsPipeline(VkDevice a_device, VkPipelineCache a_cache, const GraphicsPipelineDesc& a_desc); // blocking, thread safe
+
+  void SetViewportAndScissor(VkCommandBuffer a_cmdBuff, VkExtent2D a_extent); // for VK_DYNAMIC_STATE_VIEWPORT and VK_DYNAMIC_STATE_SCISSOR
+
+  /**
+  \brief Entry points of VK_EXT_extended_dynamic_state (cull mode, front face and topology at record time).
+
+  All pointers are null if the extension was not enabled on the device; IsExtendedDynamicStateSupported
+  checks both the extension and its feature bit (needs VK_KHR_get_physical_device_properties2 on the instance).
+  */
+  struct ExtendedDynamicStateFuncs
+  {
+    PFN_vkCmdSetCullModeEXT          vkCmdSetCullModeEXT          = nullptr;
+    PFN_vkCmdSetFrontFaceEXT         vkCmdSetFrontFaceEXT         = nullptr;
+    PFN_vkCmdSetPrimitiveTopologyEXT vkCmdSetPrimitiveTopologyEXT = nullptr;
+
+    bool IsEnabled() const { return vkCmdSetCullModeEXT != nullptr; }
+  };
+
+  bool                      IsExtendedDynamicStateSupported(VkInstance a_instance, VkPhysicalDevice a_physDevice);
+  ExtendedDynamicStateFuncs LoadExtendedDynamicState(VkDevice a_device);
+
+  /**
+  \brief Builds graphics pipelines on worker threads.
+
+  Compile returns immediately; the future becomes ready when the pipeline is built (or holds the exception).
+  Renderer should check readiness each frame (IsReady) and skip draws or use a fallback pipeline meanwhile.
+  Pipelines are owned by the compiler and destroyed in its destructor, which waits for unfinished jobs.
+  Pipeline cache is internally synchronized, so all jobs share it.
+  */
+  class PipelineCompiler
+  {
+  public:
+
+    PipelineCompiler(VkDevice a_device, VkPipelineCache a_cache, ThreadPool* a_pThreadPool);
+    ~PipelineCompiler();
+
+    PipelineCompiler(const PipelineCompiler& a_rhs)            = delete;
+    PipelineCompiler& operator=(const PipelineCompiler& a_rhs) = delete;
+
+    std::shared_future<VkPipeline> Compile(const GraphicsPipelineDesc& a_desc);
+    void                           WaitIdle();
+
+    static bool IsReady(const std::shared_future<VkPipeline>& a_future);
+
+  private:
+
+    VkDevice        m_device;
+    VkPipelineCache m_cache;
+    ThreadPool*     m_pThreadPool;
+
+    std::mutex                                  m_mutex;
+    std::vector< std::shared_future<VkPipeline> > m_jobs;
+  };
+
+  //// Pipeline deduplication
+  //
+  uint64_t HashBytes(const void* a_data, size_t a_size, uint64_t a_seed = 14695981039346656037ULL); // FNV-1a
+
+  /**
+  \brief Compact POD image of GraphicsPipelineDesc; equal keys give equal pipelines.
+
+  Shaders are represented by hashes of their code, handles by their integer values. Key is zero filled
+  before writing, so it is compared and hashed as raw bytes.
+  */
+  struct PipelineStateKey
+  {
+    enum { MAX_VERTEX_BINDINGS = 4, MAX_VERTEX_ATTRIBUTES = 8 };
+
+    struct Binding
+    {
+      uint32_t binding;
+      uint32_t stride;
+      uint32_t inputRate;
+    };
+
+    struct Attribute
+    {
+      uint32_t location;
+      uint32_t binding;
+      uint32_t format;
+      uint32_t offset;
+    };
+
+    uint64_t  vertShader;     // VkShaderModule; the content hash alone may collide, and the table compares whole keys
+    uint64_t  fragShader;     //
+    uint64_t  vertShaderHash;
+    uint64_t  fragShaderHash;
+    uint64_t  vertConstantsHash;
+    uint64_t  fragConstantsHash;
+    uint64_t  renderPass;
+    uint64_t  layout;
+    uint64_t  dynamicStateMask;
+    uint32_t  subpass;
+    uint32_t  viewportWidth;  // 0 if viewport and scissor are dynamic, so resizes do not give new pipelines
+    uint32_t  viewportHeight; //
+    uint8_t   topology;
+    uint8_t   polygonMode;
+    uint8_t   cullMode;
+    uint8_t   frontFace;
+    uint32_t  bindingCount;
+    uint32_t  attributeCount;
+    Binding   bindings[MAX_VERTEX_BINDINGS];
+    Attribute attributes[MAX_VERTEX_ATTRIBUTES];
+
+    uint64_t Hash() const { return HashBytes(this, sizeof(PipelineStateKey)); }
+    bool operator==(const PipelineStateKey& a_rhs) const;
+  };
+
+  PipelineStateKey MakePipelineStateKey(const GraphicsPipelineDesc& a_desc);
+
+  struct PipelineStateKeyHash
+  {
+    size_t operator()(const PipelineStateKey& a_key) const { return size_t(a_key.Hash()); }
+  };
+
+  /**
+  \brief Maps PipelineStateKey to a pipeline, so equal descriptions share one VkPipeline.
+
+  Find never takes a lock: the table is open addressing with atomic slot pointers; entries are immutable after
+  they are published and live as long as the registry. Insertion and growth are serialized by a mutex; a grown
+  table is published atomically and old tables are kept until destruction, because readers may still walk them.
+  Pipelines are compiled by (and owned by) PipelineCompiler.
+  */
+  class PipelineRegistry
+  {
+  public:
+
+    explicit PipelineRegistry(PipelineCompiler* a_pCompiler, uint32_t a_initialCapacity = 64);
+    ~PipelineRegistry();
+
+    PipelineRegistry(const PipelineRegistry& a_rhs)            = delete;
+    PipelineRegistry& operator=(const PipelineRegistry& a_rhs) = delete;
+
+    bool                           Find(const PipelineStateKey& a_key, std::shared_future<VkPipeline>* a_pPipeline) const; // lock free
+    std::shared_future<VkPipeline> GetOrCompile(const GraphicsPipelineDesc& a_desc); // compiles only if no equal pipeline exists
+
+    uint32_t GetCount() const { return m_count.load(std::memory_order_relaxed); }
+
+  private:
+
+    struct Entry
+    {
+      PipelineStateKey               key;
+      uint64_t                       hash;
+      std::shared_future<VkPipeline> pipeline;
+    };
+
+    struct Table
+    {
+      explicit Table(uint32_t a_capacity);
+      uint32_t                               capacity; // power of 2
+      std::unique_ptr<std::atomic<Entry*>[]> slots;
+    };
+
+    static const Entry* FindInTable(const Table* a_pTable, const PipelineStateKey& a_key, uint64_t a_hash);
+    static void         InsertToTable(Table* a_pTable, Entry* a_pEntry);
+
+    PipelineCompiler*     m_pCompiler;
+    std::atomic<Table*>   m_pTable;
+    std::atomic<uint32_t> m_count;
+
+    std::mutex                          m_writeMutex;
+    std::vector<std::unique_ptr<Table>> m_tables;  // current and retired
+    std::vector<std::unique_ptr<Entry>> m_entries;
+  };
+
+  /**
+  \brief Declares specialization constants of a pipeline and enumerates combinations of their values.
+
+  Each variant is the base description with one value chosen for every declared constant, so the driver
+  constant-folds branches on them instead of branching on uniforms at run time. Variants are numbered in mixed
+  radix, the first declared constant changes fastest. Prebuild compiles the hot variants through the registry,
+  so they land in the pipeline cache and are ready (or being built) before the first draw that needs them.
+  */
+  class ShaderVariantSet
+  {
+  public:
+
+    explicit ShaderVariantSet(const GraphicsPipelineDesc& a_base) : m_base(a_base) {}
+
+    void AddConstant(VkShaderStageFlagBits a_stage, uint32_t a_constantId, const std::vector<uint32_t>& a_values); // {0, 1} for a feature toggle
+
+    uint64_t             GetVariantCount() const;
+    uint64_t             GetVariantIndex(const std::vector<uint32_t>& a_values) const; // one value per declared constant, in declaration order
+    GraphicsPipelineDesc GetVariant(uint64_t a_index) const;
+
+    std::vector< std::shared_future<VkPipeline> > Prebuild(PipelineRegistry* a_pRegistry, const std::vector<uint64_t>& a_hotVariants) const;
+
+  private:
+
+    struct Constant
+    {
+      VkShaderStageFlagBits stage;
+      uint32_t              id;
+      std::vector<uint32_t> values;
+    };
+
+    GraphicsPipelineDesc  m_base;
+    std::vector<Constant> m_constants;
+  };
+
+  /**
+  \brief Fast pipeline linking with VK_EXT_graphics_pipeline_library.
+
+  A description is split into four library parts: vertex input, pre-rasterization shaders, fragment shader and
+  fragment output. Every part is compiled once for each distinct state it depends on, and Link only combines four
+  ready parts without link time optimization, so a new combination of known parts costs microseconds instead of
+  a full compilation. If a thread pool is given, the optimized pipeline is linked there in background; the caller
+  switches to it when its future is ready. All parts of a pipeline use the same layout (no independent sets).
+  Every pipeline is owned by the library. Thread safe.
+  IsSupported is false if the Vulkan headers do not know VK_EXT_graphics_pipeline_library.
+  */
+  class GraphicsPipelineLibrary
+  {
+  public:
+
+    static bool IsSupported(VkInstance a_instance, VkPhysicalDevice a_physDevice); // both extensions and the feature bit
+
+    GraphicsPipelineLibrary(VkDevice a_device, VkPipelineCache a_cache, ThreadPool* a_pOptimizePool = nullptr);
+    ~GraphicsPipelineLibrary(); // waits for background optimization
+
+    GraphicsPipelineLibrary(const GraphicsPipelineLibrary& a_rhs)            = delete;
+    GraphicsPipelineLibrary& operator=(const GraphicsPipelineLibrary& a_rhs) = delete;
+
+    VkPipeline Link(const GraphicsPipelineDesc& a_desc, std::shared_future<VkPipeline>* a_pOptimized = nullptr); // compiles missing parts first
+    uint32_t   GetPartCount() const;
+
+  private:
+
+    enum { PART_COUNT = 4 };
+
+    struct Linked
+    {
+      VkPipeline                     fast;
+      std::shared_future<VkPipeline> optimized; // invalid if there is no thread pool
+    };
+
+    VkPipeline GetPart(uint32_t a_partId, const GraphicsPipelineDesc& a_desc, const PipelineStateKey& a_key);
+
+    VkDevice        m_device;
+    VkPipelineCache m_cache;
+    ThreadPool*     m_pOptimizePool;
+
+    mutable std::mutex                                                     m_mutex;
+    std::unordered_map<PipelineStateKey, VkPipeline, PipelineStateKeyHash> m_parts[PART_COUNT]; // key has only the fields the part depends on
+    std::unordered_map<PipelineStateKey, Linked, PipelineStateKeyHash>     m_linked;
+  };
+
+};
+
+#endif //VULKAN_MINIMAL_GRAPHICS_VK_PIPELINE_H
@@ -0,0 +1,136 @@
+#include "vk_present.h"
+#include "vk_utils.h"
+
+#include <algorithm>
+#include <thread>
+#ifdef WIN32
+#undef min
+#undef max
+#endif
+
+static const double WORK_SMOOTHING   = 0.1;  // weight of the newest sample in averages
+static const double MIN_MARGIN_MS    = 1.0;
+static const double MISS_MARGIN_MS   = 0.5;  // added when a vblank is missed
+static const double MARGIN_DECAY_MS  = 0.01; // removed each frame that was on time
+static const double SPIN_MS          = 1.0;  // OS sleep is not precise, the rest is spent in yield loop
+
+static double ToMs(std::chrono::steady_clock::duration a_duration)
+{
+  return std::chrono::duration<double, std::milli>(a_duration).count();
+}
+
+vk_utils::FramePacer::FramePacer(VkDevice a_device, bool a_presentWaitEnabled, double a_refreshRateHz) :
+                                 m_device(a_device), m_pfnWaitForPresent(nullptr), m_presentId(0), m_hasDisplayed(false),
+                                 m_workMs(0.0), m_marginMs(2.0*MIN_MARGIN_MS), m_latencyMs(0.0)
+{
+  m_periodMs   = 1000.0/((a_refreshRateHz > 1.0) ? a_refreshRateHz : 60.0);
+  m_frameStart = Clock::now();
+
+#if defined(VK_KHR_present_id) && defined(VK_KHR_present_wait)
+  if (a_presentWaitEnabled)
+    m_pfnWaitForPresent = vkGetDeviceProcAddr(a_device, "vkWaitForPresentKHR");
+#endif
+}
+
+bool vk_utils::FramePacer::IsPresentWaitSupported(VkInstance a_instance, VkPhysicalDevice a_physDevice)
+{
+#if defined(VK_KHR_present_id) && defined(VK_KHR_present_wait)
+  if (!IsDeviceExtensionSupported(a_physDevice, VK_KHR_PRESENT_ID_EXTENSION_NAME) ||
+      !IsDeviceExtensionSupported(a_physDevice, VK_KHR_PRESENT_WAIT_EXTENSION_NAME))
+    return false;
+
+  auto getFeatures2 = (PFN_vkGetPhysicalDeviceFeatures2KHR)vkGetInstanceProcAddr(a_instance, "vkGetPhysicalDeviceFeatures2KHR");
+  if (getFeatures2 == nullptr)
+    return false;
+
+  VkPhysicalDevicePresentWaitFeaturesKHR presentWaitFeatures = {};
+  presentWaitFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+
+  VkPhysicalDevicePresentIdFeaturesKHR presentIdFeatures = {};
+  presentIdFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+  presentIdFeatures.pNext = &presentWaitFeatures;
+
+  VkPhysicalDeviceFeatures2KHR features2 = {};
+  features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+  features2.pNext = &presentIdFeatures;
+
+  getFeatures2(a_physDevice, &features2);
+  return presentIdFeatures.presentId == VK_TRUE && presentWaitFeatures.presentWait == VK_TRUE;
+#else
+  return false;
+#endif
+}
+
+void vk_utils::FramePacer::SleepUntil(Clock::time_point a_time) const
+{
+  const auto spin = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(SPIN_MS));
+  if (a_time - Clock::now() > spin)
+    std::this_thread::sleep_until(a_time - spin);
+  while (Clock::now() < a_time)
+    std::this_thread::yield();
+}
+
+void vk_utils::FramePacer::BeginFrame(VkSwapchainKHR a_swapChain)
+{
+  Clock::time_point startAt = m_frameStart + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(m_periodMs));
+
+#if defined(VK_KHR_present_id) && defined(VK_KHR_present_wait)
+  if (m_pfnWaitForPresent != nullptr && m_presentId != 0)
+  {
+    // previous frame is displayed at vblank, so this is both its latency and the phase of the display
+    //
+    const uint64_t timeoutNs = uint64_t(4.0*m_periodMs*1e6);
+    const VkResult res       = ((PFN_vkWaitForPresentKHR)m_pfnWaitForPresent)(m_device, a_swapChain, m_presentId, timeoutNs);
+    const auto     now       = Clock::now();
+
+    if (res == VK_SUCCESS || res == VK_SUBOPTIMAL_KHR)
+    {
+      const double latencyMs = ToMs(now - m_frameStart);
+      m_latencyMs = (m_latencyMs > 0.0) ? m_latencyMs + WORK_SMOOTHING*(latencyMs - m_latencyMs) : latencyMs;
+
+      if (m_hasDisplayed)
+      {
+        const double intervalMs = ToMs(now - m_lastDisplayed);
+        if (intervalMs > 1.5*m_periodMs)
+          m_marginMs = std::min(m_marginMs + MISS_MARGIN_MS, 0.5*m_periodMs); // started too late, the frame waited for one more vblank
+        else
+        {
+          m_periodMs = m_periodMs + WORK_SMOOTHING*(intervalMs - m_periodMs);
+          m_marginMs = std::max(m_marginMs - MARGIN_DECAY_MS, MIN_MARGIN_MS);
+        }
+      }
+      m_lastDisplayed = now;
+      m_hasDisplayed  = true;
+
+      const double budgetMs = std::min(m_workMs + m_marginMs, m_periodMs);
+      startAt = m_lastDisplayed + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(m_periodMs - budgetMs));
+    }
+    else // VK_TIMEOUT or VK_ERROR_OUT_OF_DATE_KHR, swap chain is going to be recreated; don't delay this frame
+    {
+      m_hasDisplayed = false;
+      startAt        = now;
+    }
+  }
+#endif
+
+  SleepUntil(startAt);
+  m_frameStart = Clock::now();
+}
+
+uint64_t vk_utils::FramePacer::NextPresentId()
+{
+  if (m_pfnWaitForPresent == nullptr)
+    return 0;
+  return ++m_presentId;
+}
+
+void vk_utils::FramePacer::EndFrame()
+{
+  m_workMs = m_workMs + WORK_SMOOTHING*(ToMs(Clock::now() - m_frameStart) - m_workMs);
+}
+
+void vk_utils::FramePacer::Reset()
+{
+  m_presentId    = 0;
+  m_hasDisplayed = false;
+}
@@ -0,0 +1,60 @@
+#ifndef VULKAN_MINIMAL_GRAPHICS_VK_PRESENT_H
+#define VULKAN_MINIMAL_GRAPHICS_VK_PRESENT_H
+
+#include <vulkan/vulkan.h>
+#include <chrono>
+#include <cstdint>
+
+namespace vk_utils
+{
+  /**
+  \brief Starts each frame as late as possible before the vblank it is going to be shown at, so input is fresh.
+
+  BeginFrame must be called before input is polled, EndFrame right after vkQueuePresentKHR. With VK_KHR_present_id and
+  VK_KHR_present_wait the pacer waits until the previous frame is actually displayed, which gives vblank time and
+  real input-to-display latency, and then sleeps until (next vblank - CPU frame time - margin). Margin grows when a
+  vblank is missed and slowly shrinks otherwise, so GPU time is covered without measuring it.
+  Without these extensions frames are only limited to the refresh rate from a CPU timer: vblank phase is unknown,
+  but frames do not queue up in front of the display, which is where most of the latency comes from.
+  Present ids belong to a swap chain, so call Reset after it is recreated. Not thread safe.
+  */
+  class FramePacer
+  {
+  public:
+
+    FramePacer(VkDevice a_device, bool a_presentWaitEnabled, double a_refreshRateHz);
+
+    static bool IsPresentWaitSupported(VkInstance a_instance, VkPhysicalDevice a_physDevice); // both extensions and their features
+
+    void     BeginFrame(VkSwapchainKHR a_swapChain);
+    uint64_t NextPresentId(); // 0 if present wait is not used, otherwise chain VkPresentIdKHR with it to vkQueuePresentKHR
+    void     EndFrame();
+    void     Reset();
+
+    bool     IsPresentWaitEnabled() const { return m_pfnWaitForPresent != nullptr; }
+    double   GetLatencyMs()         const { return m_latencyMs; } // frame start to display, averaged; 0 if unknown
+    double   GetPeriodMs()          const { return m_periodMs;  }
+
+  private:
+
+    typedef std::chrono::steady_clock Clock;
+
+    void SleepUntil(Clock::time_point a_time) const;
+
+    VkDevice                 m_device;
+    PFN_vkVoidFunction       m_pfnWaitForPresent; // vkWaitForPresentKHR, null if present wait is not enabled or unknown to Vulkan headers
+
+    uint64_t                 m_presentId;     // last one passed to vkQueuePresentKHR, 0 if none for this swap chain
+    Clock::time_point        m_frameStart;    // of the frame that is recorded now or was recorded last
+    Clock::time_point        m_lastDisplayed; // vblank of the last displayed frame
+    bool                     m_hasDisplayed;
+
+    double                   m_periodMs;      // display refresh interval, refined by measured vblanks
+    double                   m_workMs;        // CPU time from BeginFrame to EndFrame, averaged
+    double                   m_marginMs;      // covers GPU time and scheduling jitter
+    double                   m_latencyMs;     // frame start to display, averaged
+  };
+
+};
+
+#endif //VULKAN_MINIMAL_GRAPHICS_VK_PRESENT_H
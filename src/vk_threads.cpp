@@ -0,0 +1,189 @@
+#include "vk_threads.h"
+#include "vk_trace.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+#ifdef WIN32
+#undef min
+#undef max
+#endif
+
+vk_utils::ThreadPool::ThreadPool(uint32_t a_threadCount) : m_stop(false)
+{
+  if (a_threadCount == 0)
+  {
+    const uint32_t hwThreads = std::thread::hardware_concurrency(); // may return 0 if unknown
+    a_threadCount = std::max(hwThreads, 2u) - 1;                    // main thread has its own work
+  }
+
+  for (uint32_t i = 0; i < a_threadCount; i++)
+    m_threads.push_back(std::thread(&ThreadPool::WorkerLoop, this));
+}
+
+vk_utils::ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_jobAdded.notify_all();
+
+  for (auto& thread : m_threads)
+    thread.join();
+}
+
+void vk_utils::ThreadPool::Enqueue(std::function<void()> a_job)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_jobs.push_back(a_job);
+  }
+  m_jobAdded.notify_one();
+}
+
+void vk_utils::ThreadPool::WorkerLoop()
+{
+  while (true)
+  {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_jobAdded.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+
+      if (m_jobs.empty()) // stopped and nothing left to do
+        return;
+
+      job = m_jobs.front();
+      m_jobs.pop_front();
+    }
+    job(); // packaged_task keeps exceptions in its future
+  }
+}
+
+vk_utils::TaskGraph::TaskId vk_utils::TaskGraph::Add(const char* a_name, std::function<void()> a_job, const std::vector<TaskId>& a_deps)
+{
+  return AddTask(a_name, a_job, a_deps, false);
+}
+
+vk_utils::TaskGraph::TaskId vk_utils::TaskGraph::AddMainThread(const char* a_name, std::function<void()> a_job, const std::vector<TaskId>& a_deps)
+{
+  return AddTask(a_name, a_job, a_deps, true);
+}
+
+vk_utils::TaskGraph::TaskId vk_utils::TaskGraph::AddTask(const char* a_name, std::function<void()> a_job, const std::vector<TaskId>& a_deps, bool a_mainThread)
+{
+  const TaskId id = TaskId(m_tasks.size());
+
+  Task task;
+  task.name       = a_name;
+  task.job        = a_job;
+  task.mainThread = a_mainThread;
+  task.waitCount  = 0;
+
+  for (TaskId dep : a_deps)
+  {
+    if (dep >= id)
+      throw std::runtime_error("[TaskGraph::Add]: dependency must be added before its dependent");
+    m_tasks[dep].dependents.push_back(id);
+    task.waitCount++;
+  }
+
+  m_tasks.push_back(task);
+  return id;
+}
+
+void vk_utils::TaskGraph::Run()
+{
+  std::vector<TaskId> ready;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (TaskId id = 0; id < TaskId(m_tasks.size()); id++)
+    {
+      if (m_tasks[id].waitCount != 0)
+        continue;
+      if (m_tasks[id].mainThread)
+        m_mainReady.push_back(id);
+      else
+        ready.push_back(id);
+    }
+  }
+
+  for (TaskId id : ready)
+    m_pPool->Submit([this, id]() { Execute(id); });
+
+  while (true)
+  {
+    TaskId id;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_changed.wait(lock, [this]() { return !m_mainReady.empty() || m_finishedCount == m_tasks.size(); });
+
+      if (m_mainReady.empty()) // everything is finished
+        break;
+
+      id = m_mainReady.front();
+      m_mainReady.pop_front();
+    }
+    Execute(id);
+  }
+
+  if (m_error)
+    std::rethrow_exception(m_error);
+}
+
+void vk_utils::TaskGraph::Execute(TaskId a_id)
+{
+  std::exception_ptr error;
+  {
+    TraceScope scope(m_tasks[a_id].name);
+    try
+    {
+      m_tasks[a_id].job();
+    }
+    catch (...)
+    {
+      error = std::current_exception();
+    }
+  }
+  Finish(a_id, std::move(error));
+}
+
+void vk_utils::TaskGraph::Finish(TaskId a_id, std::exception_ptr a_error)
+{
+  std::vector<TaskId> ready;
+  ThreadPool*         pPool = m_pPool;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (a_error && !m_error)
+      m_error = a_error;
+    a_error = nullptr; // no reference to the exception may outlive the lock, Run rethrows and frees it after the last Finish
+
+    // after an error dependents are not started, but they are still counted as finished
+    //
+    std::vector<TaskId> finished(1, a_id);
+    while (!finished.empty())
+    {
+      const TaskId id = finished.back();
+      finished.pop_back();
+      m_finishedCount++;
+
+      for (TaskId dependent : m_tasks[id].dependents)
+      {
+        if (--m_tasks[dependent].waitCount != 0)
+          continue;
+        if (m_error)
+          finished.push_back(dependent);
+        else if (m_tasks[dependent].mainThread)
+          m_mainReady.push_back(dependent);
+        else
+          ready.push_back(dependent);
+      }
+    }
+
+    m_changed.notify_all(); // under the lock: Run may return and destroy the graph right after it is released
+  }
+
+  for (TaskId id : ready) // non empty only if the graph is not finished, so 'this' is still alive
+    pPool->Submit([this, id]() { Execute(id); });
+}
@@ -0,0 +1,159 @@
+#ifndef VULKAN_MINIMAL_GRAPHICS_VK_THREADS_H
+#define VULKAN_MINIMAL_GRAPHICS_VK_THREADS_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <exception>
+#include <atomic>
+
+namespace vk_utils
+{
+  /**
+  \brief Fixed set of worker threads that execute jobs in FIFO order.
+
+  Submit returns std::future of the job result; exceptions thrown by a job are stored in the future.
+  Destructor finishes all jobs that are already queued.
+  */
+  class ThreadPool
+  {
+  public:
+
+    explicit ThreadPool(uint32_t a_threadCount = 0); // 0 means (hardware threads - 1), but at least 1
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool& a_rhs)            = delete;
+    ThreadPool& operator=(const ThreadPool& a_rhs) = delete;
+
+    template<typename Func>
+    auto Submit(Func a_func) -> std::future<decltype(a_func())>
+    {
+      typedef decltype(a_func()) ResultType;
+      auto pTask = std::make_shared< std::packaged_task<ResultType()> >(a_func); // std::function needs copyable functor
+      std::future<ResultType> res = pTask->get_future();
+      Enqueue([pTask]() { (*pTask)(); });
+      return res;
+    }
+
+    uint32_t GetThreadCount() const { return uint32_t(m_threads.size()); }
+
+  private:
+
+    void Enqueue(std::function<void()> a_job);
+    void WorkerLoop();
+
+    std::vector<std::thread>          m_threads;
+    std::deque<std::function<void()>> m_jobs;
+    std::mutex                        m_mutex;
+    std::condition_variable           m_jobAdded;
+    bool                              m_stop;
+  };
+
+  /**
+  \brief Bounded lock-free queue for exactly one producer thread and one consumer thread.
+
+  Capacity is rounded up to a power of two. TryPush fails if the queue is full and TryPop if it is empty; neither
+  blocks, takes a lock or allocates memory, so the producer may be an OS callback and the consumer a render loop.
+  */
+  template<typename T>
+  class SpscQueue
+  {
+  public:
+
+    explicit SpscQueue(size_t a_capacity) : m_head(0), m_tail(0)
+    {
+      size_t capacity = 1;
+      while (capacity < a_capacity)
+        capacity *= 2;
+      m_items.resize(capacity);
+      m_mask = capacity - 1;
+    }
+
+    SpscQueue(const SpscQueue& a_rhs)            = delete;
+    SpscQueue& operator=(const SpscQueue& a_rhs) = delete;
+
+    bool TryPush(const T& a_item) // producer thread only
+    {
+      const size_t tail = m_tail.load(std::memory_order_relaxed);
+      if (tail - m_head.load(std::memory_order_acquire) == m_items.size())
+        return false;
+      m_items[tail & m_mask] = a_item;
+      m_tail.store(tail + 1, std::memory_order_release); // publishes the item
+      return true;
+    }
+
+    bool TryPop(T* a_pItem) // consumer thread only
+    {
+      const size_t head = m_head.load(std::memory_order_relaxed);
+      if (head == m_tail.load(std::memory_order_acquire))
+        return false;
+      *a_pItem = m_items[head & m_mask];
+      m_head.store(head + 1, std::memory_order_release); // slot may be reused by producer
+      return true;
+    }
+
+  private:
+
+    std::vector<T>      m_items;
+    size_t              m_mask;
+    std::atomic<size_t> m_head;        // next item to pop, written by consumer; both only grow
+    char                m_padding[64]; // head and tail on different cache lines, so the threads do not fight for one
+    std::atomic<size_t> m_tail;        // next slot to push, written by producer
+  };
+
+  /**
+  \brief Jobs with dependencies; each job is started on the thread pool as soon as all jobs it depends on are finished.
+
+  Jobs added with AddMainThread run on the thread that calls Run, for APIs like GLFW that are bound to the main thread.
+  Dependencies must be added before their dependents, so the graph can not have cycles. Each job is traced with its name.
+  If a job throws, jobs that depend on it are skipped, Run waits for the running ones and rethrows the first exception.
+  A graph is run once.
+  */
+  class TaskGraph
+  {
+  public:
+
+    typedef uint32_t TaskId;
+
+    explicit TaskGraph(ThreadPool* a_pPool) : m_pPool(a_pPool), m_finishedCount(0) {}
+
+    TaskGraph(const TaskGraph& a_rhs)            = delete;
+    TaskGraph& operator=(const TaskGraph& a_rhs) = delete;
+
+    TaskId Add          (const char* a_name, std::function<void()> a_job, const std::vector<TaskId>& a_deps = std::vector<TaskId>());
+    TaskId AddMainThread(const char* a_name, std::function<void()> a_job, const std::vector<TaskId>& a_deps = std::vector<TaskId>());
+
+    void Run(); // blocks until all jobs are finished
+
+  private:
+
+    struct Task
+    {
+      const char*           name; // string literal
+      std::function<void()> job;
+      bool                  mainThread;
+      uint32_t              waitCount;  // unfinished dependencies
+      std::vector<TaskId>   dependents;
+    };
+
+    TaskId AddTask(const char* a_name, std::function<void()> a_job, const std::vector<TaskId>& a_deps, bool a_mainThread);
+    void   Execute(TaskId a_id);
+    void   Finish(TaskId a_id, std::exception_ptr a_error);
+
+    ThreadPool*             m_pPool;
+    std::vector<Task>       m_tasks;     // not resized while running
+    std::deque<TaskId>      m_mainReady; // main thread jobs with all dependencies finished
+    size_t                  m_finishedCount;
+    std::exception_ptr      m_error;
+    std::mutex              m_mutex;
+    std::condition_variable m_changed;
+  };
+
+};
+
+#endif //VULKAN_MINIMAL_GRAPHICS_VK_THREADS_H
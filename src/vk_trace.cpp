@@ -0,0 +1,158 @@
+#include "vk_trace.h"
+
+#include <stdio.h>
+#include <iomanip>
+#include <string>
+
+static thread_local uint32_t g_traceDepth    = 0;
+static thread_local uint32_t g_traceThreadId = 0; // 0 means not assigned yet
+
+static uint32_t CurrentThreadId()
+{
+  static std::atomic<uint32_t> nextId(1);
+  if (g_traceThreadId == 0)
+    g_traceThreadId = nextId.fetch_add(1);
+  return g_traceThreadId;
+}
+
+vk_utils::StartupTracer& vk_utils::StartupTracer::Instance()
+{
+  static StartupTracer tracer; // thread safe initialization in C++11
+  return tracer;
+}
+
+vk_utils::StartupTracer::StartupTracer() : m_start(std::chrono::steady_clock::now()), m_enabled(true)
+{
+  m_events.reserve(256);
+}
+
+int64_t vk_utils::StartupTracer::NowNs() const
+{
+  return int64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count());
+}
+
+size_t vk_utils::StartupTracer::Begin(const char* a_name)
+{
+  if (!m_enabled.load(std::memory_order_relaxed))
+    return NO_EVENT;
+
+  Event event;
+  event.name     = a_name;
+  event.threadId = CurrentThreadId();
+  event.depth    = g_traceDepth++;
+  event.endNs    = -1;
+  event.beginNs  = NowNs();
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_events.push_back(event);
+  return m_events.size() - 1;
+}
+
+void vk_utils::StartupTracer::End(size_t a_eventId)
+{
+  if (a_eventId == NO_EVENT)
+    return;
+
+  const int64_t now = NowNs();
+  g_traceDepth--;
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_events[a_eventId].endNs = now;
+}
+
+void vk_utils::StartupTracer::Stop()
+{
+  m_enabled.store(false, std::memory_order_relaxed);
+}
+
+void vk_utils::StartupTracer::PrintSummary(std::ostream& a_out) const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  // events of a thread are stored in begin order, so children follow their parent; self time = own - direct children
+  //
+  uint32_t maxThreadId = 0;
+  for (const auto& event : m_events)
+    maxThreadId = (event.threadId > maxThreadId) ? event.threadId : maxThreadId;
+
+  const std::ios::fmtflags oldFlags = a_out.flags();
+  a_out << std::fixed << std::setprecision(3);
+  a_out << "[StartupTracer]:     total ms      self ms  scope" << std::endl;
+
+  for (uint32_t threadId = 1; threadId <= maxThreadId; threadId++)
+  {
+    if (maxThreadId > 1)
+      a_out << "thread " << threadId << ":" << std::endl;
+
+    for (size_t i = 0; i < m_events.size(); i++)
+    {
+      const Event& event = m_events[i];
+      if (event.threadId != threadId)
+        continue;
+
+      const int64_t endNs   = (event.endNs >= 0) ? event.endNs : NowNs();
+      int64_t       childNs = 0;
+      for (size_t j = i + 1; j < m_events.size(); j++)
+      {
+        const Event& child = m_events[j];
+        if (child.threadId != threadId)
+          continue;
+        if (child.depth <= event.depth)
+          break;
+        if (child.depth == event.depth + 1)
+          childNs += ((child.endNs >= 0) ? child.endNs : NowNs()) - child.beginNs;
+      }
+
+      const double totalMs = double(endNs - event.beginNs)*1e-6;
+      const double selfMs  = double(endNs - event.beginNs - childNs)*1e-6;
+      a_out << "  " << std::setw(16) << totalMs << " " << std::setw(12) << selfMs << "  " << std::string(event.depth*2, ' ') << event.name;
+      if (event.endNs < 0)
+        a_out << " (not finished)";
+      a_out << std::endl;
+    }
+  }
+
+  a_out.flags(oldFlags);
+}
+
+static void WriteJsonString(FILE* a_file, const char* a_str)
+{
+  fputc('"', a_file);
+  for (const char* p = a_str; *p != '\0'; p++)
+  {
+    if (*p == '"' || *p == '\\')
+      fputc('\\', a_file);
+    if ((unsigned char)(*p) >= 0x20)
+      fputc(*p, a_file);
+  }
+  fputc('"', a_file);
+}
+
+bool vk_utils::StartupTracer::SaveChromeTrace(const char* a_fileName) const
+{
+  FILE* fp = fopen(a_fileName, "w");
+  if (fp == NULL)
+  {
+    fprintf(stderr, "[StartupTracer::SaveChromeTrace]: can't open %s\n", a_fileName);
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  for (size_t i = 0; i < m_events.size(); i++)
+  {
+    const Event&  event = m_events[i];
+    const int64_t endNs = (event.endNs >= 0) ? event.endNs : NowNs();
+
+    fprintf(fp, "  {\"name\": ");
+    WriteJsonString(fp, event.name);
+    fprintf(fp, ", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f}%s\n", event.threadId,
+            double(event.beginNs)*1e-3, double(endNs - event.beginNs)*1e-3, (i + 1 == m_events.size()) ? "" : ",");
+  }
+  fprintf(fp, "]}\n");
+
+  const bool ok = (ferror(fp) == 0);
+  fclose(fp);
+  return ok;
+}
@@ -0,0 +1,76 @@
+#ifndef VULKAN_MINIMAL_GRAPHICS_VK_TRACE_H
+#define VULKAN_MINIMAL_GRAPHICS_VK_TRACE_H
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <cstdint>
+
+namespace vk_utils
+{
+  /**
+  \brief Records nested timed scopes for startup analysis; use TRACE_SCOPE("name") instead of Begin/End.
+
+  Scopes nest per thread, so work on the thread pool shows up as separate tracks. PrintSummary writes an indented
+  breakdown (inclusive and self time), SaveChromeTrace writes JSON for chrome://tracing or ui.perfetto.dev.
+  Names are not copied, they must be string literals. Recording ends with Stop, so scopes in code that also runs
+  later (swap chain recreation, pipeline compilation) do not grow the event list forever. Thread safe.
+  */
+  class StartupTracer
+  {
+  public:
+
+    static StartupTracer& Instance();
+
+    static const size_t NO_EVENT = size_t(-1);
+
+    size_t Begin(const char* a_name); // returns event index for End, NO_EVENT after Stop
+    void   End(size_t a_eventId);     // ignores NO_EVENT
+    void   Stop();                    // scopes that are open now are still finished
+
+    void   PrintSummary(std::ostream& a_out) const;
+    bool   SaveChromeTrace(const char* a_fileName) const;
+
+  private:
+
+    StartupTracer();
+
+    struct Event
+    {
+      const char* name;
+      uint32_t    threadId; // small numbers in order of the first event on a thread
+      uint32_t    depth;
+      int64_t     beginNs;  // from tracer creation
+      int64_t     endNs;    // -1 while the scope is open
+    };
+
+    int64_t NowNs() const;
+
+    std::chrono::steady_clock::time_point m_start;
+    mutable std::mutex                    m_mutex;
+    std::vector<Event>                    m_events;
+    std::atomic<bool>                     m_enabled;
+  };
+
+  class TraceScope
+  {
+  public:
+    explicit TraceScope(const char* a_name) : m_eventId(StartupTracer::Instance().Begin(a_name)) {}
+    ~TraceScope() { StartupTracer::Instance().End(m_eventId); }
+
+    TraceScope(const TraceScope& a_rhs)            = delete;
+    TraceScope& operator=(const TraceScope& a_rhs) = delete;
+
+  private:
+    size_t m_eventId;
+  };
+
+};
+
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b)      TRACE_CONCAT_IMPL(a, b)
+#define TRACE_SCOPE(name)       vk_utils::TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+
+#endif //VULKAN_MINIMAL_GRAPHICS_VK_TRACE_H
@@ -3,6 +3,7 @@
 //
 
 #include "vk_utils.h"
+#include "vk_trace.h"
 
 #include <string.h>
 #include <assert.h>
@@ -11,9 +12,17 @@
 #include <cmath>
 
 #include <algorithm>
+#include <map>
+#include <mutex>
 #ifdef WIN32
+#include <windows.h>
 #undef min
 #undef max
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif 
 
 char g_validationLayerData[256];
@@ -27,6 +36,7 @@ static const char* g_debugReportExtName  = VK_EXT_DEBUG_REPORT_EXTENSION_NAME;
 
 VkInstance vk_utils::CreateInstance(bool a_enableValidationLayers, std::vector<const char *>& a_enabledLayers, std::vector<const char *> a_extentions)
 {
+  TRACE_SCOPE("CreateInstance");
   std::vector<const char *> enabledExtensions = a_extentions;
 
   /*
@@ -36,6 +46,8 @@ VkInstance vk_utils::CreateInstance(bool a_enableValidationLayers, std::vector<c
   */
   if (a_enableValidationLayers)
   {
+    TRACE_SCOPE("find validation layer");
+
     /*
     We get all supported layers with vkEnumerateInstanceLayerProperties.
     */
@@ -126,7 +138,10 @@ VkInstance vk_utils::CreateInstance(bool a_enableValidationLayers, std::vector<c
   Having created the instance, we can actually start using vulkan.
   */
   VkInstance instance;
-  VK_CHECK_RESULT(vkCreateInstance(&createInfo, NULL, &instance));
+  {
+    TRACE_SCOPE("vkCreateInstance"); // loader and layers are initialized here, usually the most of CreateInstance
+    VK_CHECK_RESULT(vkCreateInstance(&createInfo, NULL, &instance));
+  }
 
   return instance;
 }
@@ -134,6 +149,7 @@ VkInstance vk_utils::CreateInstance(bool a_enableValidationLayers, std::vector<c
 
 void vk_utils::InitDebugReportCallback(VkInstance a_instance, DebugReportCallbackFuncType a_callback, VkDebugReportCallbackEXT* a_debugReportCallback)
 {
+  TRACE_SCOPE("InitDebugReportCallback");
   // Register a callback function for the extension VK_EXT_DEBUG_REPORT_EXTENSION_NAME, so that warnings emitted from the validation
   // layer are actually printed.
 
@@ -169,6 +185,7 @@ void vk_utils::InitDebugReportCallback(VkInstance a_instance, DebugReportCallbac
 
 VkPhysicalDevice vk_utils::FindPhysicalDevice(VkInstance a_instance, bool a_printInfo, int a_preferredDeviceId)
 {
+  TRACE_SCOPE("FindPhysicalDevice");
   /*
   In this function, we find a physical device that can be used with Vulkan.
   */
@@ -289,16 +306,91 @@ uint32_t vk_utils::GetQueueFamilyIndex(VkPhysicalDevice a_physicalDevice, VkQueu
 }
 
 
+uint32_t vk_utils::GetTransferQueueFamilyIndex(VkPhysicalDevice a_physicalDevice, uint32_t a_fallbackFamily)
+{
+  uint32_t queueFamilyCount;
+  vkGetPhysicalDeviceQueueFamilyProperties(a_physicalDevice, &queueFamilyCount, NULL);
+
+  std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+  vkGetPhysicalDeviceQueueFamilyProperties(a_physicalDevice, &queueFamilyCount, queueFamilies.data());
+
+  // graphics and compute families support transfer implicitly, so a family that reports only transfer is a dedicated copy engine
+  //
+  for (uint32_t i = 0; i < queueFamilyCount; ++i)
+  {
+    const VkQueueFlags flags = queueFamilies[i].queueFlags;
+    if (queueFamilies[i].queueCount > 0 && (flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)))
+      return i;
+  }
+
+  return a_fallbackFamily;
+}
+
+
+bool vk_utils::IsInstanceExtensionSupported(const char* a_extName)
+{
+  TRACE_SCOPE("IsInstanceExtensionSupported");
+  uint32_t extCount = 0;
+  vkEnumerateInstanceExtensionProperties(NULL, &extCount, NULL);
+
+  std::vector<VkExtensionProperties> extensions(extCount);
+  vkEnumerateInstanceExtensionProperties(NULL, &extCount, extensions.data());
+
+  for (const auto& ext : extensions)
+  {
+    if (strcmp(ext.extensionName, a_extName) == 0)
+      return true;
+  }
+  return false;
+}
+
+bool vk_utils::IsDeviceExtensionSupported(VkPhysicalDevice a_physicalDevice, const char* a_extName)
+{
+  TRACE_SCOPE("IsDeviceExtensionSupported");
+  uint32_t extCount = 0;
+  vkEnumerateDeviceExtensionProperties(a_physicalDevice, NULL, &extCount, NULL);
+
+  std::vector<VkExtensionProperties> extensions(extCount);
+  vkEnumerateDeviceExtensionProperties(a_physicalDevice, NULL, &extCount, extensions.data());
+
+  for (const auto& ext : extensions)
+  {
+    if (strcmp(ext.extensionName, a_extName) == 0)
+      return true;
+  }
+  return false;
+}
+
+
 VkDevice vk_utils::CreateLogicalDevice(uint32_t queueFamilyIndex, VkPhysicalDevice physicalDevice, const std::vector<const char *>& a_enabledLayers, std::vector<const char *> a_extentions)
 {
-  // When creating the device, we also specify what queues it has.
+  return CreateLogicalDevice(std::vector<uint32_t>(1, queueFamilyIndex), physicalDevice, a_enabledLayers, a_extentions);
+}
+
+VkDevice vk_utils::CreateLogicalDevice(const std::vector<uint32_t>& a_queueFamilies, VkPhysicalDevice physicalDevice, const std::vector<const char *>& a_enabledLayers, std::vector<const char *> a_extentions,
+                                       const void* a_pFeatureChain)
+{
+  TRACE_SCOPE("CreateLogicalDevice");
+  // When creating the device, we also specify what queues it has; each family may be listed only once.
   //
-  VkDeviceQueueCreateInfo queueCreateInfo = {};
-  queueCreateInfo.sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-  queueCreateInfo.queueFamilyIndex = queueFamilyIndex;
-  queueCreateInfo.queueCount       = 1;    // create one queue in this family. We don't need more.
-  float queuePriorities            = 1.0;  // we only have one queue, so this is not that imporant.
-  queueCreateInfo.pQueuePriorities = &queuePriorities;
+  float queuePriorities = 1.0;  // we have one queue per family, so this is not that imporant.
+
+  std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
+  for (uint32_t family : a_queueFamilies)
+  {
+    bool alreadyAdded = false;
+    for (const auto& info : queueCreateInfos)
+      alreadyAdded = alreadyAdded || (info.queueFamilyIndex == family);
+    if (alreadyAdded)
+      continue;
+
+    VkDeviceQueueCreateInfo queueCreateInfo = {};
+    queueCreateInfo.sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queueCreateInfo.queueFamilyIndex = family;
+    queueCreateInfo.queueCount       = 1;    // create one queue in this family. We don't need more.
+    queueCreateInfo.pQueuePriorities = &queuePriorities;
+    queueCreateInfos.push_back(queueCreateInfo);
+  }
 
   // Now we create the logical device. The logical device allows us to interact with the physical device.
   //
@@ -309,10 +401,11 @@ VkDevice vk_utils::CreateLogicalDevice(uint32_t queueFamilyIndex, VkPhysicalDevi
   VkPhysicalDeviceFeatures deviceFeatures = {};
 
   deviceCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+  deviceCreateInfo.pNext = a_pFeatureChain;                           // extension features, e.g. VkPhysicalDeviceExtendedDynamicStateFeaturesEXT
   deviceCreateInfo.enabledLayerCount    = uint32_t(a_enabledLayers.size());  // need to specify validation layers here as well.
   deviceCreateInfo.ppEnabledLayerNames  = a_enabledLayers.data();
-  deviceCreateInfo.pQueueCreateInfos    = &queueCreateInfo;        // when creating the logical device, we also specify what queues it has.
-  deviceCreateInfo.queueCreateInfoCount = 1;
+  deviceCreateInfo.pQueueCreateInfos    = queueCreateInfos.data();        // when creating the logical device, we also specify what queues it has.
+  deviceCreateInfo.queueCreateInfoCount = uint32_t(queueCreateInfos.size());
   deviceCreateInfo.pEnabledFeatures     = &deviceFeatures;
   deviceCreateInfo.enabledExtensionCount   = static_cast<uint32_t>(a_extentions.size());
   deviceCreateInfo.ppEnabledExtensionNames = a_extentions.data();
@@ -324,24 +417,95 @@ VkDevice vk_utils::CreateLogicalDevice(uint32_t queueFamilyIndex, VkPhysicalDevi
 }
 
 
-uint32_t vk_utils::FindMemoryType(uint32_t memoryTypeBits, VkMemoryPropertyFlags properties, VkPhysicalDevice physicalDevice)
+const VkPhysicalDeviceMemoryProperties& vk_utils::GetMemoryProperties(VkPhysicalDevice physicalDevice)
 {
-  VkPhysicalDeviceMemoryProperties memoryProperties;
+  static std::mutex                                                  cacheMutex;
+  static std::map<VkPhysicalDevice, VkPhysicalDeviceMemoryProperties> cache;
 
-  vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+  std::lock_guard<std::mutex> lock(cacheMutex);
+
+  auto p = cache.find(physicalDevice);
+  if (p == cache.end())
+  {
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+    p = cache.insert(std::make_pair(physicalDevice, memoryProperties)).first;
+  }
+
+  return p->second; // map nodes are never moved, so the reference stays valid
+}
+
+vk_utils::MemoryTypeRequest vk_utils::GetMemoryTypeRequest(MEMORY_USAGE a_usage)
+{
+  switch (a_usage)
+  {
+  case MEMORY_USAGE_STREAMING:
+    return MemoryTypeRequest(VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+
+  case MEMORY_USAGE_STAGING:
+    return MemoryTypeRequest(VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 0, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+
+  case MEMORY_USAGE_READBACK:
+    return MemoryTypeRequest(VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_CACHED_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 0);
+
+  default:
+    return MemoryTypeRequest(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT); // keep small BAR heap for streaming
+  };
+}
+
+static uint32_t CountBits(uint32_t a_bits)
+{
+  uint32_t res = 0;
+  for (; a_bits != 0; a_bits &= (a_bits - 1))
+    res++;
+  return res;
+}
+
+std::vector<uint32_t> vk_utils::GetMemoryTypeCandidates(uint32_t memoryTypeBits, const MemoryTypeRequest& a_request, VkPhysicalDevice physicalDevice)
+{
+  const VkPhysicalDeviceMemoryProperties& memoryProperties = GetMemoryProperties(physicalDevice);
+
+  // lazily allocated and protected memory are only good when asked explicitly
+  //
+  const VkMemoryPropertyFlags special = VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT | VK_MEMORY_PROPERTY_PROTECTED_BIT;
+  const VkMemoryPropertyFlags avoid   = a_request.avoid | (special & ~(a_request.required | a_request.preferred));
 
   /*
-  How does this search work?
-  See the documentation of VkPhysicalDeviceMemoryProperties for a detailed description.
+  Each missing preferred flag and each present flag to avoid costs 1.
+  Memory types with equal cost keep the driver order, which is already sorted by performance.
   */
+  std::vector< std::pair<uint32_t, uint32_t> > costAndIndex;
   for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; ++i)
   {
-    if ((memoryTypeBits & (1 << i)) &&
-        ((memoryProperties.memoryTypes[i].propertyFlags & properties) == properties))
-      return i;
+    const VkMemoryPropertyFlags flags = memoryProperties.memoryTypes[i].propertyFlags;
+    if ((memoryTypeBits & (1 << i)) == 0 || (flags & a_request.required) != a_request.required)
+      continue;
+    if ((flags & VK_MEMORY_PROPERTY_PROTECTED_BIT) && !(a_request.required & VK_MEMORY_PROPERTY_PROTECTED_BIT))
+      continue;
+
+    const uint32_t cost = CountBits(a_request.preferred & ~flags) + CountBits(avoid & flags);
+    costAndIndex.push_back(std::make_pair(cost, i));
   }
 
-  return -1;
+  std::stable_sort(costAndIndex.begin(), costAndIndex.end());
+
+  std::vector<uint32_t> res(costAndIndex.size());
+  for (size_t i = 0; i < costAndIndex.size(); i++)
+    res[i] = costAndIndex[i].second;
+  return res;
+}
+
+uint32_t vk_utils::FindMemoryType(uint32_t memoryTypeBits, const MemoryTypeRequest& a_request, VkPhysicalDevice physicalDevice)
+{
+  std::vector<uint32_t> candidates = GetMemoryTypeCandidates(memoryTypeBits, a_request, physicalDevice);
+  if (candidates.empty())
+    RUN_TIME_ERROR("vk_utils::FindMemoryType, no memory type with required properties");
+  return candidates[0];
+}
+
+uint32_t vk_utils::FindMemoryType(uint32_t memoryTypeBits, VkMemoryPropertyFlags properties, VkPhysicalDevice physicalDevice)
+{
+  return FindMemoryType(memoryTypeBits, MemoryTypeRequest(properties), physicalDevice);
 }
 
 std::vector<uint32_t> vk_utils::ReadFile(const char* filename)
@@ -376,10 +540,16 @@ std::vector<uint32_t> vk_utils::ReadFile(const char* filename)
 
 VkShaderModule vk_utils::CreateShaderModule(VkDevice a_device, const std::vector<uint32_t>& code)
 {
+  return CreateShaderModule(a_device, code.data(), code.size() * sizeof(uint32_t));
+}
+
+VkShaderModule vk_utils::CreateShaderModule(VkDevice a_device, const uint32_t* a_code, size_t a_sizeInBytes)
+{
+  TRACE_SCOPE("CreateShaderModule");
   VkShaderModuleCreateInfo createInfo = {};
   createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-  createInfo.codeSize = code.size() * sizeof(uint32_t);
-  createInfo.pCode = code.data();
+  createInfo.codeSize = a_sizeInBytes;
+  createInfo.pCode = a_code;
 
   VkShaderModule shaderModule;
   if (vkCreateShaderModule(a_device, &createInfo, nullptr, &shaderModule) != VK_SUCCESS)
@@ -388,6 +558,97 @@ VkShaderModule vk_utils::CreateShaderModule(VkDevice a_device, const std::vector
   return shaderModule;
 }
 
+void vk_utils::CheckSpirv(const void* a_code, size_t a_sizeInBytes, const char* a_name)
+{
+  const uint32_t SPIRV_MAGIC = 0x07230203;
+
+  if (a_code == nullptr || a_sizeInBytes < sizeof(uint32_t) || a_sizeInBytes % sizeof(uint32_t) != 0 || (size_t)(a_code) % alignof(uint32_t) != 0 ||
+      *(const uint32_t*)a_code != SPIRV_MAGIC)
+  {
+    std::string errorMsg = std::string("[CheckSpirv]: not a SPIR-V binary: ") + std::string(a_name);
+    RUN_TIME_ERROR(errorMsg.c_str());
+  }
+}
+
+#ifdef WIN32
+
+vk_utils::MappedFile::MappedFile(const char* a_fileName) : m_data(nullptr), m_size(0), m_file(INVALID_HANDLE_VALUE), m_mapping(NULL)
+{
+  m_file = CreateFileA(a_fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (m_file == INVALID_HANDLE_VALUE)
+  {
+    std::string errorMsg = std::string("vk_utils::MappedFile, can't open file ") + std::string(a_fileName);
+    RUN_TIME_ERROR(errorMsg.c_str());
+  }
+
+  LARGE_INTEGER fileSize;
+  GetFileSizeEx(m_file, &fileSize);
+  m_size = size_t(fileSize.QuadPart);
+  if (m_size == 0)
+    return;
+
+  m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (m_mapping != NULL)
+    m_data = MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+
+  if (m_data == nullptr)
+  {
+    if (m_mapping != NULL)
+      CloseHandle(m_mapping);
+    CloseHandle(m_file);                 // destructor is not called for a throwing constructor
+    std::string errorMsg = std::string("vk_utils::MappedFile, can't map file ") + std::string(a_fileName);
+    RUN_TIME_ERROR(errorMsg.c_str());
+  }
+}
+
+vk_utils::MappedFile::~MappedFile()
+{
+  if (m_data != nullptr)
+    UnmapViewOfFile(m_data);
+  if (m_mapping != NULL)
+    CloseHandle(m_mapping);
+  if (m_file != INVALID_HANDLE_VALUE)
+    CloseHandle(m_file);
+}
+
+#else
+
+vk_utils::MappedFile::MappedFile(const char* a_fileName) : m_data(nullptr), m_size(0)
+{
+  const int fd = open(a_fileName, O_RDONLY);
+  if (fd < 0)
+  {
+    std::string errorMsg = std::string("vk_utils::MappedFile, can't open file ") + std::string(a_fileName);
+    RUN_TIME_ERROR(errorMsg.c_str());
+  }
+
+  struct stat fileInfo;
+  if (fstat(fd, &fileInfo) == 0)
+    m_size = size_t(fileInfo.st_size);
+
+  if (m_size != 0)
+  {
+    void* pData = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (pData != MAP_FAILED)
+      m_data = pData;
+  }
+  close(fd); // mapping stays valid without the descriptor
+
+  if (m_size != 0 && m_data == nullptr)
+  {
+    std::string errorMsg = std::string("vk_utils::MappedFile, can't map file ") + std::string(a_fileName);
+    RUN_TIME_ERROR(errorMsg.c_str());
+  }
+}
+
+vk_utils::MappedFile::~MappedFile()
+{
+  if (m_data != nullptr)
+    munmap(const_cast<void*>(m_data), m_size);
+}
+
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -435,17 +696,15 @@ VkSurfaceFormatKHR ChooseSwapSurfaceFormat(const std::vector<VkSurfaceFormatKHR>
   return availableFormats[0];
 }
 
-VkPresentModeKHR ChooseSwapPresentMode(const std::vector<VkPresentModeKHR>& availablePresentModes) 
+VkPresentModeKHR ChooseSwapPresentMode(const std::vector<VkPresentModeKHR>& availablePresentModes, const std::vector<VkPresentModeKHR>& a_preferred) 
 {
-  for (const auto& availablePresentMode : availablePresentModes) 
+  for (VkPresentModeKHR preferred : a_preferred)
   {
-    if (availablePresentMode == VK_PRESENT_MODE_MAILBOX_KHR)
-      return availablePresentMode;
-    else if (availablePresentMode == VK_PRESENT_MODE_IMMEDIATE_KHR)
-      return availablePresentMode;
+    if (std::find(availablePresentModes.begin(), availablePresentModes.end(), preferred) != availablePresentModes.end())
+      return preferred;
   }
 
-  return VK_PRESENT_MODE_FIFO_KHR;
+  return VK_PRESENT_MODE_FIFO_KHR; // the only one that is always supported
 }
 
 VkExtent2D ChooseSwapExtent(const VkSurfaceCapabilitiesKHR& capabilities, int a_width, int a_height) 
@@ -465,17 +724,69 @@ VkExtent2D ChooseSwapExtent(const VkSurfaceCapabilitiesKHR& capabilities, int a_
   }
 }
 
+vk_utils::SwapChainPolicy vk_utils::GetSwapChainPolicy(LATENCY_POLICY a_policy)
+{
+  SwapChainPolicy policy;
+  switch (a_policy)
+  {
+  case LATENCY_POLICY_LOWEST:
+    policy.presentModes   = { VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR };
+    policy.extraImages    = 1;
+    policy.framesInFlight = 1;
+    policy.framePacing    = true;
+    break;
+
+  case LATENCY_POLICY_THROUGHPUT:
+    policy.presentModes   = { VK_PRESENT_MODE_FIFO_KHR };
+    policy.extraImages    = 2;
+    policy.framesInFlight = 3;
+    break;
+
+  case LATENCY_POLICY_POWER_SAVING:
+    policy.presentModes   = { VK_PRESENT_MODE_FIFO_KHR };
+    policy.extraImages    = 0;
+    policy.framesInFlight = 2;
+    break;
+  };
+  return policy;
+}
+
+const char* vk_utils::GetPresentModeName(VkPresentModeKHR a_mode)
+{
+  switch (a_mode)
+  {
+  case VK_PRESENT_MODE_IMMEDIATE_KHR:    return "IMMEDIATE";
+  case VK_PRESENT_MODE_MAILBOX_KHR:      return "MAILBOX";
+  case VK_PRESENT_MODE_FIFO_KHR:         return "FIFO";
+  case VK_PRESENT_MODE_FIFO_RELAXED_KHR: return "FIFO_RELAXED";
+  default:                               return "UNKNOWN";
+  };
+}
+
+VkSurfaceFormatKHR vk_utils::ChooseSurfaceFormat(VkPhysicalDevice a_physDevice, VkSurfaceKHR a_surface)
+{
+  uint32_t formatCount = 0;
+  vkGetPhysicalDeviceSurfaceFormatsKHR(a_physDevice, a_surface, &formatCount, nullptr);
+  if (formatCount == 0)
+    RUN_TIME_ERROR("[vk_utils::ChooseSurfaceFormat]: surface has no formats");
+
+  std::vector<VkSurfaceFormatKHR> formats(formatCount);
+  vkGetPhysicalDeviceSurfaceFormatsKHR(a_physDevice, a_surface, &formatCount, formats.data());
+  return ChooseSwapSurfaceFormat(formats);
+}
+
 
 void vk_utils::CreateCwapChain(VkPhysicalDevice a_physDevice, VkDevice a_device, VkSurfaceKHR a_surface, int a_width, int a_height,
-                               ScreenBufferResources* a_buff)
+                               ScreenBufferResources* a_buff, VkSwapchainKHR a_oldSwapChain, const SwapChainPolicy& a_policy)
 {
+  TRACE_SCOPE("CreateCwapChain");
   SwapChainSupportDetails swapChainSupport = QuerySwapChainSupport(a_physDevice, a_surface);
 
   VkSurfaceFormatKHR surfaceFormat = ChooseSwapSurfaceFormat(swapChainSupport.formats);
-  VkPresentModeKHR presentMode     = ChooseSwapPresentMode(swapChainSupport.presentModes);
+  VkPresentModeKHR presentMode     = ChooseSwapPresentMode(swapChainSupport.presentModes, a_policy.presentModes);
   VkExtent2D extent                = ChooseSwapExtent(swapChainSupport.capabilities, a_width, a_height);
 
-  uint32_t imageCount = swapChainSupport.capabilities.minImageCount + 1;
+  uint32_t imageCount = swapChainSupport.capabilities.minImageCount + a_policy.extraImages;
   if (swapChainSupport.capabilities.maxImageCount > 0 && imageCount > swapChainSupport.capabilities.maxImageCount) {
     imageCount = swapChainSupport.capabilities.maxImageCount;
   }
@@ -494,7 +805,7 @@ void vk_utils::CreateCwapChain(VkPhysicalDevice a_physDevice, VkDevice a_device,
   createInfo.compositeAlpha   = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
   createInfo.presentMode      = presentMode;
   createInfo.clipped          = VK_TRUE;
-  createInfo.oldSwapchain     = VK_NULL_HANDLE;
+  createInfo.oldSwapchain     = a_oldSwapChain; // lets the driver reuse its images and memory
 
   if (vkCreateSwapchainKHR(a_device, &createInfo, nullptr, &a_buff->swapChain) != VK_SUCCESS)
     throw std::runtime_error("[vk_utils::CreateCwapChain]: failed to create swap chain!");
@@ -505,10 +816,12 @@ void vk_utils::CreateCwapChain(VkPhysicalDevice a_physDevice, VkDevice a_device,
 
   a_buff->swapChainImageFormat = surfaceFormat.format;
   a_buff->swapChainExtent      = extent;
+  a_buff->presentMode          = presentMode;
 }
 
 void vk_utils::CreateScreenImageViews(VkDevice a_device, ScreenBufferResources* pScreen)
 {
+  TRACE_SCOPE("CreateScreenImageViews");
   pScreen->swapChainImageViews.resize(pScreen->swapChainImages.size());
 
   for (size_t i = 0; i < pScreen->swapChainImages.size(); i++)
@@ -536,6 +849,7 @@ void vk_utils::CreateScreenImageViews(VkDevice a_device, ScreenBufferResources*
 
 void vk_utils::CreateScreenFrameBuffers(VkDevice a_device, VkRenderPass a_renderPass, ScreenBufferResources* pScreen)
 {
+  TRACE_SCOPE("CreateScreenFrameBuffers");
   pScreen->swapChainFramebuffers.resize(pScreen->swapChainImageViews.size());
 
   for (size_t i = 0; i < pScreen->swapChainImageViews.size(); i++) 
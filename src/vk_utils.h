@@ -38,7 +38,36 @@ namespace vk_utils
 
   uint32_t GetQueueFamilyIndex(VkPhysicalDevice a_physicalDevice, VkQueueFlagBits a_bits);
   uint32_t GetComputeQueueFamilyIndex(VkPhysicalDevice a_physicalDevice);
+  uint32_t GetTransferQueueFamilyIndex(VkPhysicalDevice a_physicalDevice, uint32_t a_fallbackFamily); // transfer-only family (DMA engine) if device has one, a_fallbackFamily otherwise
   VkDevice CreateLogicalDevice(uint32_t queueFamilyIndex, VkPhysicalDevice physicalDevice, const std::vector<const char *>& a_enabledLayers, std::vector<const char *> a_extentions = std::vector<const char *>());
+  bool     IsInstanceExtensionSupported(const char* a_extName);
+  bool     IsDeviceExtensionSupported(VkPhysicalDevice a_physicalDevice, const char* a_extName);
+  VkDevice CreateLogicalDevice(const std::vector<uint32_t>& a_queueFamilies, VkPhysicalDevice physicalDevice, const std::vector<const char *>& a_enabledLayers, std::vector<const char *> a_extentions = std::vector<const char *>(),
+                               const void* a_pFeatureChain = nullptr); // one queue per unique family; a_pFeatureChain goes to VkDeviceCreateInfo::pNext
+
+  //// Memory type selection
+  //
+  const VkPhysicalDeviceMemoryProperties& GetMemoryProperties(VkPhysicalDevice physicalDevice); // queried only once per physical device
+
+  struct MemoryTypeRequest
+  {
+    MemoryTypeRequest(VkMemoryPropertyFlags a_required = 0, VkMemoryPropertyFlags a_preferred = 0, VkMemoryPropertyFlags a_avoid = 0) :
+                      required(a_required), preferred(a_preferred), avoid(a_avoid) {}
+
+    VkMemoryPropertyFlags required;  // memory type must have all of these flags
+    VkMemoryPropertyFlags preferred; // each missing flag makes memory type less attractive
+    VkMemoryPropertyFlags avoid;     // each present flag makes memory type less attractive
+  };
+
+  enum MEMORY_USAGE { MEMORY_USAGE_GPU_ONLY  = 0,   // device local, never touched by CPU
+                      MEMORY_USAGE_STREAMING = 1,   // CPU writes, GPU reads; device local and host visible (resizable BAR) if available
+                      MEMORY_USAGE_STAGING   = 2,   // source of transfer operations; plain host memory
+                      MEMORY_USAGE_READBACK  = 3 }; // GPU writes, CPU reads; host cached if available
+
+  MemoryTypeRequest     GetMemoryTypeRequest(MEMORY_USAGE a_usage);
+  std::vector<uint32_t> GetMemoryTypeCandidates(uint32_t memoryTypeBits, const MemoryTypeRequest& a_request, VkPhysicalDevice physicalDevice); // best first
+
+  uint32_t FindMemoryType(uint32_t memoryTypeBits, const MemoryTypeRequest& a_request, VkPhysicalDevice physicalDevice);
   uint32_t FindMemoryType(uint32_t memoryTypeBits, VkMemoryPropertyFlags properties, VkPhysicalDevice physicalDevice);
 
   //// FrameBuffer and SwapChain issues
@@ -49,12 +78,31 @@ namespace vk_utils
     std::vector<VkImage>       swapChainImages;
     VkFormat                   swapChainImageFormat;
     VkExtent2D                 swapChainExtent;
+    VkPresentModeKHR           presentMode;
     std::vector<VkImageView>   swapChainImageViews;
     std::vector<VkFramebuffer> swapChainFramebuffers;
   };
 
+  enum LATENCY_POLICY { LATENCY_POLICY_LOWEST       = 0,   // 1 frame in flight, MAILBOX or IMMEDIATE, frame pacing; input is sampled as late as possible
+                        LATENCY_POLICY_THROUGHPUT   = 1,   // 3 frames in flight and extra images, FIFO; GPU never starves
+                        LATENCY_POLICY_POWER_SAVING = 2 }; // 2 frames in flight, minimal images, FIFO; never renders faster than display
+
+  struct SwapChainPolicy
+  {
+    std::vector<VkPresentModeKHR> presentModes   = { VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR }; // most preferred first, FIFO if none is supported
+    uint32_t                      extraImages    = 1; // images above VkSurfaceCapabilitiesKHR::minImageCount
+    uint32_t                      framesInFlight = 2; // CPU frames recorded ahead of GPU; the swap chain does not use it, the frame loop does
+    bool                          framePacing    = false; // frame loop delays input sampling toward vblank (FramePacer)
+  };
+
+  SwapChainPolicy GetSwapChainPolicy(LATENCY_POLICY a_policy);
+  const char*     GetPresentModeName(VkPresentModeKHR a_mode);
+
   void CreateCwapChain(VkPhysicalDevice a_physDevice, VkDevice a_device, VkSurfaceKHR a_surface, int a_width, int a_height,
-                       ScreenBufferResources* a_buff);
+                       ScreenBufferResources* a_buff, VkSwapchainKHR a_oldSwapChain = VK_NULL_HANDLE, // old one is retired, but must still be destroyed by the caller
+                       const SwapChainPolicy& a_policy = SwapChainPolicy());
+
+  VkSurfaceFormatKHR ChooseSurfaceFormat(VkPhysicalDevice a_physDevice, VkSurfaceKHR a_surface); // the one CreateCwapChain takes; lets render passes be created before the swap chain
 
   void CreateScreenImageViews(VkDevice a_device, ScreenBufferResources* pScreen);
 
@@ -62,6 +110,36 @@ namespace vk_utils
 
   std::vector<uint32_t> ReadFile(const char* filename);
   VkShaderModule CreateShaderModule(VkDevice a_device, const std::vector<uint32_t>& code);
+  VkShaderModule CreateShaderModule(VkDevice a_device, const uint32_t* a_code, size_t a_sizeInBytes);
+  void           CheckSpirv(const void* a_code, size_t a_sizeInBytes, const char* a_name); // throws if size, alignment or magic number are not of SPIR-V
+
+  /**
+  \brief Read-only view of a whole file through mmap (MapViewOfFile on Windows); no copy to heap memory.
+
+  Data is page aligned, so it can be passed as SPIR-V directly. Empty file gives Data() == nullptr.
+  */
+  class MappedFile
+  {
+  public:
+
+    explicit MappedFile(const char* a_fileName); // throws if the file can not be opened or mapped
+    ~MappedFile();
+
+    MappedFile(const MappedFile& a_rhs)            = delete;
+    MappedFile& operator=(const MappedFile& a_rhs) = delete;
+
+    const void* Data() const { return m_data; }
+    size_t      Size() const { return m_size; }
+
+  private:
+
+    const void* m_data;
+    size_t      m_size;
+  #ifdef WIN32
+    void*       m_file;    // HANDLE
+    void*       m_mapping; // HANDLE
+  #endif
+  };
 };
 
 #undef  RUN_TIME_ERROR